@@ -7,27 +7,58 @@
  * - 软件 PWM 算法，提供细腻震动反馈
  *
  * 编译：
- * gcc -O2 -o trimui_inputd_proxy proxy.c -lm
+ * gcc -O2 -o trimui_inputd_proxy trimui_inputd_proxy.c -lm -pthread
+ * 震动状态机的 libFuzzer 入口 (见 --stress):
+ * clang -O1 -g -DTRIMUI_FUZZ -fsanitize=fuzzer,address,undefined -o rumble_fuzz trimui_inputd_proxy.c -lm -pthread
  */
 
+#define _GNU_SOURCE
 #include <linux/uinput.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
 #include <poll.h>
 #include <time.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <linux/gpio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <spawn.h>
+#include <grp.h>
+
+// 旧内核头文件没有这两个访问宏
+#ifndef input_event_sec
+#define input_event_sec  time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
 
 /* ============================================================
  * 配置与常量
+ * 以下均为默认值, 可由配置文件 (CONFIG_PATH 或 --config) 和命令行覆盖
  * ============================================================ */
+#define CONFIG_PATH      "/etc/trimui_inputd.conf"   // 不存在时只用默认值
+
 // 完美伪装成原厂手柄
 #define DEVICE_NAME      "TRIMUI Player1"
 #define DEVICE_VENDOR    0x045e
@@ -35,56 +66,558 @@
 #define DEVICE_VERSION   0x0114
 
 // 配合脚本的隐藏路径
-#define REAL_DEV_PATH    "/dev/input/trimui_raw"
-#define RUMBLE_GPIO_PATH "/sys/class/gpio/gpio227/value"
+#define REAL_DEV_PATH    "/dev/input/trimui_raw"   // 热插拔时监视其所在目录
+#define RUMBLE_GPIO_NUM  227     // 全局编号, 用于在 /dev/gpiochipN 中定位同一根线
+#define RUMBLE_GPIO_SYSFS "/sys/class/gpio/gpio%d/value"   // 没有 gpiochip 时按编号退回 sysfs
 
 // PWM 震动参数 (调节手感)
 #define RUMBLE_DEADZONE   2000   // 忽略极微小的噪音信号
-#define PWM_THRESHOLD     40000  // 超过此强度全速震动，低于此强度脉冲震动
+#define PWM_THRESHOLD     40000  // 超过此强度全速震动，低于此强度按比例调节占空比
 #define SAFETY_TIMEOUT_MS 3000   // 最长震动时间，防止卡死
+#define PWM_CARRIER_HZ    50     // PWM 载波频率, 每周期两次唤醒
+#define PWM_MIN_DUTY      200    // 刚过死区时的占空比 (千分比), 低于此马达转不起来
+#define RUMBLE_GAMMA      1.0    // 死区与 PWM_THRESHOLD 之间强度 -> 占空比曲线的指数
+#define RUMBLE_MAX_DUTY   1000   // 占空比上限 (千分比)
+#define RUMBLE_KICK_MS    0      // 低强度起震时先全速转动的时长, 0 表示不启用
+#define PWM_MIN_PULSE_US  1000   // 短于此的高/低电平没有意义, 直接取整
+#define RUMBLE_STRONG_WEIGHT 256 // 强/弱马达强度的合成权重 (Q8)
+#define RUMBLE_WEAK_WEIGHT   128
+#define RUMBLE_BUDGET_PCT    50      // 滑动窗口内平均占空比上限, 超过后降额而不是停震, 0 表示不限
+#define RUMBLE_BUDGET_WINDOW_S 10
+
+// 硬件 PWM 通道 (--hwpwm), 只有确认接到马达的 pwmchip 才能启用
+#define RUMBLE_HWPWM_CHIP    NULL    // 例如 "/sys/class/pwm/pwmchip0"
+#define RUMBLE_HWPWM_CHANNEL 0
+#define RUMBLE_HWPWM_HZ      20000   // 硬件载波, 高于人耳范围
+
+// 独立震动线程 (--rt-rumble)
+#define RT_RUMBLE_PRIO    20     // SCHED_FIFO 优先级
+#define RT_RUMBLE_CPU     -1     // 绑定的 CPU, -1 表示最后一个核
+
+#define CONTROL_SOCK_PATH "/run/trimui_inputd.sock"   // 放在只有 root 可写的目录下
+#define CONTROL_SOCK_MODE 0660   // 属主和属组 (--control-group) 可发送指令
+#define PAD_MAX           2      // 虚拟手柄数: Player1, 以及有 --player2 时的 Player2
+#define PAD_PHYS_PLAYER2  "trimui-inputd/player2"
+#define STATS_PATH        "/run/trimui_inputd.stats"   // 运行统计共享页 (--stats)
+#define IDLE_TIMEOUT_S    30     // 无输入无震动多久后进入空闲 (--idle-timeout)
+
+// 单轴滤波参数 (--filter / --axis)
+typedef struct {
+    bool enabled;
+    int  deadzone;         // 死区, 千分比 (相对半量程); 摇杆对按径向计算
+    int  hysteresis;       // 迟滞, 输出单位: 变化不超过此值时不输出
+    bool calibrated;       // 使用下面的校准值, 否则取设备 absinfo
+    int  cal_min, cal_center, cal_max;
+} axis_param_t;
+
+typedef struct {
+    bool rt_rumble;        // 震动放到独立实时线程
+    int  rt_cpu;
+    int  rt_prio;
+    const char *hwpwm_chip;    // NULL 表示只用 GPIO 软件 PWM
+    int  hwpwm_channel;
+    int  hwpwm_hz;
+    int  gpio_num;             // 震动马达 GPIO (--gpio)
+    const char *gpio_path;     // sysfs value 文件, NULL 表示按 gpio_num 推出
+    const char *pad_name;      // 虚拟手柄名字/ID, 未设置时照抄真实设备
+    bool pad_id_set;
+    struct input_id pad_id;
+    int  rumble_deadzone;      // 强度死区与满速阈值 (--rumble-range)
+    int  rumble_full;
+    int  rumble_timeout_ms;    // 单个效果的最长播放时间
+    int  rumble_weight[2];     // 强/弱马达强度的合成权重 (Q8)
+    int  pwm_hz;               // 软件 PWM 载波与最短脉冲
+    int  pwm_min_pulse_us;
+    double rumble_gamma;       // 响应曲线 (--rumble-curve)
+    int  rumble_min_duty;
+    int  rumble_max_duty;
+    int  rumble_kick_ms;       // 起震全速脉冲 (--rumble-kick)
+    int  rumble_budget;        // 平均占空比上限, 百分比 (--rumble-budget)
+    int  rumble_window_s;
+    bool latency;              // 统计转发延迟, SIGUSR1 输出
+    int  abs_rate;             // 摇杆/扳机帧的输出频率上限 (--abs-rate), 0 表示不限
+    int  trigger_keys[2];      // 扳机转 L2/R2 的按下/松开阈值 (--trigger-keys), 0 表示不启用
+    int  stick_dpad[2];        // 左摇杆转十字键 (--stick-dpad)
+    axis_param_t axis[ABS_CNT];
+    const char *profile;       // 启动时使用的方案 (--profile)
+    const char *remap_file;    // 所有方案共用的基础规则 (--map)
+    const char *profile_dir;   // 额外方案目录, 每个 NAME.conf 一个方案
+    const char *control_path;  // 控制 socket, NULL 表示不开启
+    gid_t control_gid;         // 控制 socket 的属组, -1 表示不改
+    int  idle_timeout;         // 秒, 0 表示不进入空闲
+    const char *stats_path;    // 统计共享页, NULL 表示只在进程内计数
+    bool show_stats;           // 打印统计共享页后退出
+    const char *record_path;   // 录制转发的事件与 FF 指令
+    const char *replay_path;   // 回放录制文件到虚拟手柄后退出
+    bool bench;                // 离机基准测试后退出
+    long stress;               // 震动状态机压力测试的指令数, 0 表示不运行
+    const char *bench_trace;   // 录制的 input_event 原始文件, NULL 则合成
+} proxy_config_t;
+
+static proxy_config_t g_cfg = {
+    .rt_rumble = false,
+    .rt_cpu    = RT_RUMBLE_CPU,
+    .rt_prio   = RT_RUMBLE_PRIO,
+    .hwpwm_chip    = RUMBLE_HWPWM_CHIP,
+    .hwpwm_channel = RUMBLE_HWPWM_CHANNEL,
+    .hwpwm_hz      = RUMBLE_HWPWM_HZ,
+    .gpio_num      = RUMBLE_GPIO_NUM,
+    .rumble_deadzone   = RUMBLE_DEADZONE,
+    .rumble_full       = PWM_THRESHOLD,
+    .rumble_timeout_ms = SAFETY_TIMEOUT_MS,
+    .rumble_weight     = { RUMBLE_STRONG_WEIGHT, RUMBLE_WEAK_WEIGHT },
+    .pwm_hz            = PWM_CARRIER_HZ,
+    .pwm_min_pulse_us  = PWM_MIN_PULSE_US,
+    .rumble_gamma    = RUMBLE_GAMMA,
+    .rumble_min_duty = PWM_MIN_DUTY,
+    .rumble_max_duty = RUMBLE_MAX_DUTY,
+    .rumble_kick_ms  = RUMBLE_KICK_MS,
+    .rumble_budget   = RUMBLE_BUDGET_PCT,
+    .rumble_window_s = RUMBLE_BUDGET_WINDOW_S,
+    .idle_timeout  = IDLE_TIMEOUT_S,
+    .control_gid   = (gid_t)-1,
+};
 
 static volatile sig_atomic_t keep_running = 1;
 
+// 按键/轴位图, 布局与内核 EVIOCGBIT 一致
+#define BITS_PER_LONG   (sizeof(long) * 8)
+#define NLONGS(x)       (((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline bool bit_test(const unsigned long *map, unsigned int bit) {
+    return (map[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1UL;
+}
+
+static inline void bit_assign(unsigned long *map, unsigned int bit, bool on) {
+    unsigned long m = 1UL << (bit % BITS_PER_LONG);
+    if (on) map[bit / BITS_PER_LONG] |= m;
+    else    map[bit / BITS_PER_LONG] &= ~m;
+}
+
+/* ============================================================
+ * 运行统计: 计数器放在 /run 下 mmap 的共享页里, 外部工具直接读取, 不用和守护进程通信.
+ * 每个计数器只有一个线程写, 用 relaxed 原子存储, 热路径上没有额外开销
+ * ============================================================ */
+#define STATS_MAGIC   "TRIMSTAT"
+#define STATS_VERSION 2
+
+// 共享页布局; 新字段只加在末尾并提升版本. 计数跨进程重启累加, 读两次求差即速率
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t size;           // sizeof(stats_t)
+    uint32_t pid;            // 正在运行的进程, 0 表示已退出
+    uint32_t starts;         // 累计启动次数
+    uint64_t started;        // 本次启动时间 (CLOCK_REALTIME 秒)
+    uint64_t ev_syn;         // 写入虚拟手柄的事件, 按类型; SYN 即帧数
+    uint64_t ev_key;
+    uint64_t ev_abs;
+    uint64_t ev_other;
+    uint64_t writes;         // 输出批, 即 write 调用数
+    uint64_t write_short;    // 只写进一部分
+    uint64_t write_again;    // EAGAIN, 整批丢失
+    uint64_t write_errors;   // 其它错误
+    uint64_t write_queued;   // 没写完、转入积压队列的批
+    uint64_t queue_overflows; // 积压队列满, 整体换成一帧当前状态
+    uint64_t syn_dropped;    // 来源设备内核缓冲溢出
+    uint64_t ff_uploads;
+    uint64_t ff_erases;
+    uint64_t ff_plays;
+    uint64_t motor_on_us;    // 马达运行时间按占空比折算成满速
+    uint64_t wakeups;        // 主循环唤醒次数
+} stats_t;
+
+// 没有共享页时计到进程内, 热路径不用判断
+static stats_t g_stats_local;
+static stats_t *g_stats = &g_stats_local;
+
+#define STAT_ADD(field, n) \
+    __atomic_store_n(&g_stats->field, g_stats->field + (n), __ATOMIC_RELAXED)
+
+// 文件已有同版本的计数则接着累加
+static int stats_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    bool fresh = fstat(fd, &st) < 0 || st.st_size != (off_t)sizeof(stats_t);
+    // 两次截断分开检查: 文件短于映射长度时第一次计数就会 SIGBUS, 失败则只在进程内计数
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(stats_t)) < 0)) {
+        close(fd);
+        return -1;
+    }
+    stats_t *map = mmap(NULL, sizeof(stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    if (fresh || memcmp(map->magic, STATS_MAGIC, sizeof(map->magic)) != 0 ||
+        map->version != STATS_VERSION || map->size != sizeof(stats_t)) {
+        memset(map, 0, sizeof(*map));
+        memcpy(map->magic, STATS_MAGIC, sizeof(map->magic));
+        map->version = STATS_VERSION;
+        map->size = sizeof(stats_t);
+    }
+    map->starts++;
+    map->started = (uint64_t)time(NULL);
+    map->pid = (uint32_t)getpid();
+    g_stats = map;
+    return 0;
+}
+
+static void stats_close(void) {
+    if (g_stats == &g_stats_local) return;
+    g_stats->pid = 0;
+    munmap(g_stats, sizeof(stats_t));
+    g_stats = &g_stats_local;
+}
+
+// --show-stats: 只读映射后逐项打印, 供脚本解析
+static int stats_show(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    const stats_t *m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(stats_t))
+        m = mmap(NULL, sizeof(stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED || memcmp(m->magic, STATS_MAGIC, sizeof(m->magic)) != 0 ||
+        m->version != STATS_VERSION) {
+        fprintf(stderr, "%s is not a stats file of this version\n", path);
+        if (m != MAP_FAILED) munmap((void *)m, sizeof(stats_t));
+        return 1;
+    }
+    printf("pid %u\nstarts %u\nstarted %llu\n", m->pid, m->starts, (unsigned long long)m->started);
+    printf("ev_syn %llu\nev_key %llu\nev_abs %llu\nev_other %llu\n",
+           (unsigned long long)m->ev_syn, (unsigned long long)m->ev_key,
+           (unsigned long long)m->ev_abs, (unsigned long long)m->ev_other);
+    printf("writes %llu\nwrite_short %llu\nwrite_again %llu\nwrite_errors %llu\n"
+           "write_queued %llu\nqueue_overflows %llu\nsyn_dropped %llu\nff_uploads %llu\nff_erases %llu\nff_plays %llu\n"
+           "motor_on_ms %llu\nwakeups %llu\n",
+           (unsigned long long)m->writes, (unsigned long long)m->write_short,
+           (unsigned long long)m->write_again, (unsigned long long)m->write_errors,
+           (unsigned long long)m->write_queued, (unsigned long long)m->queue_overflows,
+           (unsigned long long)m->syn_dropped, (unsigned long long)m->ff_uploads,
+           (unsigned long long)m->ff_erases, (unsigned long long)m->ff_plays,
+           (unsigned long long)(m->motor_on_us / 1000), (unsigned long long)m->wakeups);
+    munmap((void *)m, sizeof(stats_t));
+    return 0;
+}
+
 /* ============================================================
  * GPIO 控制
  * ============================================================ */
+// 优先使用字符设备 (/dev/gpiochipN 的 line handle, 每次翻转一个 ioctl),
+// 不可用 (内核太老或该线已被 sysfs 导出) 时退回 sysfs value 写入
+typedef struct {
+    const char *name;
+    int  (*open)(void);            // 成功返回 fd
+    void (*write)(int fd, int state);
+} gpio_backend_t;
+
 static int g_gpio_fd = -1;
 static int g_gpio_last_state = -1;
+static const gpio_backend_t *g_gpio_backend;
+
+static int read_sysfs_int(const char *path, int *out) {
+    char buf[32];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    *out = atoi(buf);
+    return 0;
+}
+
+// 由全局编号找到所属 gpiochip 的设备节点和线内偏移
+static int gpio_chip_lookup(int gpio, char *dev, size_t dev_len, unsigned int *offset) {
+    DIR *d = opendir("/sys/class/gpio");
+    if (!d) return -1;
+
+    int ret = -1;
+    struct dirent *de;
+    while (ret < 0 && (de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, "gpiochip", 8) != 0) continue;
+
+        char path[512];
+        int base, ngpio;
+        snprintf(path, sizeof(path), "/sys/class/gpio/%s/base", de->d_name);
+        if (read_sysfs_int(path, &base) < 0) continue;
+        snprintf(path, sizeof(path), "/sys/class/gpio/%s/ngpio", de->d_name);
+        if (read_sysfs_int(path, &ngpio) < 0) continue;
+        if (gpio < base || gpio >= base + ngpio) continue;
+
+        // 字符设备名与 sysfs 的 gpiochip<base> 不同, 在父设备目录下找 gpiochipN
+        snprintf(path, sizeof(path), "/sys/class/gpio/%s/device", de->d_name);
+        DIR *pd = opendir(path);
+        if (!pd) continue;
+        struct dirent *ce;
+        while ((ce = readdir(pd)) != NULL) {
+            if (strncmp(ce->d_name, "gpiochip", 8) != 0) continue;
+            snprintf(dev, dev_len, "/dev/%s", ce->d_name);
+            *offset = (unsigned int)(gpio - base);
+            ret = 0;
+            break;
+        }
+        closedir(pd);
+    }
+    closedir(d);
+    return ret;
+}
+
+static int gpio_cdev_request_v1(int chip_fd, unsigned int offset) {
+    struct gpiohandle_request req;
+    memset(&req, 0, sizeof(req));
+    req.lineoffsets[0] = offset;
+    req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+    req.lines = 1;
+    strncpy(req.consumer_label, "trimui_inputd_proxy", sizeof(req.consumer_label) - 1);
+    if (ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req) < 0) return -1;
+    return req.fd;
+}
+
+#ifdef GPIO_V2_LINE_SET_VALUES_IOCTL
+static int gpio_cdev_request_v2(int chip_fd, unsigned int offset) {
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = offset;
+    req.num_lines = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    strncpy(req.consumer, "trimui_inputd_proxy", sizeof(req.consumer) - 1);
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) return -1;
+    return req.fd;
+}
+
+static bool g_gpio_cdev_v2;
+#endif
+
+static int gpio_cdev_open(void) {
+    char dev[288];
+    unsigned int offset;
+    if (gpio_chip_lookup(g_cfg.gpio_num, dev, sizeof(dev), &offset) < 0) return -1;
+
+    int chip_fd = open(dev, O_RDWR | O_CLOEXEC);
+    if (chip_fd < 0) return -1;
+
+    int fd = -1;
+#ifdef GPIO_V2_LINE_SET_VALUES_IOCTL
+    fd = gpio_cdev_request_v2(chip_fd, offset);
+    g_gpio_cdev_v2 = fd >= 0;
+#endif
+    // 原厂 4.9 内核只有 v1 的 line handle 接口
+    if (fd < 0) fd = gpio_cdev_request_v1(chip_fd, offset);
+    close(chip_fd);
+    return fd;
+}
+
+static void gpio_cdev_write(int fd, int state) {
+#ifdef GPIO_V2_LINE_SET_VALUES_IOCTL
+    if (g_gpio_cdev_v2) {
+        struct gpio_v2_line_values v = { .bits = state ? 1 : 0, .mask = 1 };
+        ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v);
+        return;
+    }
+#endif
+    struct gpiohandle_data d;
+    memset(&d, 0, sizeof(d));
+    d.values[0] = state ? 1 : 0;
+    ioctl(fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &d);
+}
+
+static int gpio_sysfs_open(void) {
+    return open(g_cfg.gpio_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static void gpio_sysfs_write(int fd, int state) {
+    char v = state ? '1' : '0';
+    write(fd, &v, 1);
+}
+
+static const gpio_backend_t g_gpio_backends[] = {
+    { "gpiochip", gpio_cdev_open,  gpio_cdev_write },
+    { "sysfs",    gpio_sysfs_open, gpio_sysfs_write },
+};
 
 static void gpio_init(void) {
-    g_gpio_fd = open(RUMBLE_GPIO_PATH, O_WRONLY | O_NONBLOCK);
+    for (size_t i = 0; i < sizeof(g_gpio_backends) / sizeof(g_gpio_backends[0]); i++) {
+        g_gpio_fd = g_gpio_backends[i].open();
+        if (g_gpio_fd >= 0) {
+            g_gpio_backend = &g_gpio_backends[i];
+            printf("Rumble GPIO %d via %s backend.\n", g_cfg.gpio_num, g_gpio_backend->name);
+            return;
+        }
+    }
+    fprintf(stderr, "WARN: Rumble GPIO %d unavailable, rumble disabled.\n", g_cfg.gpio_num);
 }
 
 static void gpio_set(int state) {
     if (state == g_gpio_last_state) return;
-    if (g_gpio_fd >= 0) {
-        char v = state ? '1' : '0';
-        write(g_gpio_fd, &v, 1);
-    }
+    if (g_gpio_fd >= 0) g_gpio_backend->write(g_gpio_fd, state);
     g_gpio_last_state = state;
 }
 
+/* ============================================================
+ * 马达输出 (硬件 PWM 通道优先, 否则 GPIO 软件 PWM)
+ * ============================================================ */
+static int g_hwpwm_duty_fd = -1;
+static int g_hwpwm_enable_fd = -1;
+static long g_hwpwm_period_ns;
+static int g_hwpwm_last_duty = -1;
+
+static int sysfs_write_str(const char *path, const char *val) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, val, strlen(val));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+static void hwpwm_init(void) {
+    if (!g_cfg.hwpwm_chip) return;
+
+    char dir[256], path[320], val[32];
+    snprintf(dir, sizeof(dir), "%s/pwm%d", g_cfg.hwpwm_chip, g_cfg.hwpwm_channel);
+    if (access(dir, F_OK) != 0) {
+        snprintf(path, sizeof(path), "%s/export", g_cfg.hwpwm_chip);
+        snprintf(val, sizeof(val), "%d", g_cfg.hwpwm_channel);
+        if (sysfs_write_str(path, val) < 0 || access(dir, F_OK) != 0) {
+            fprintf(stderr, "WARN: No PWM channel %s, using software PWM.\n", dir);
+            return;
+        }
+    }
+
+    // 先清零 duty, 否则新周期小于旧 duty 时内核会拒绝
+    g_hwpwm_period_ns = 1000000000L / g_cfg.hwpwm_hz;
+    snprintf(path, sizeof(path), "%s/duty_cycle", dir);
+    sysfs_write_str(path, "0");
+    g_hwpwm_duty_fd = open(path, O_WRONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "%s/period", dir);
+    snprintf(val, sizeof(val), "%ld", g_hwpwm_period_ns);
+    sysfs_write_str(path, val);
+    snprintf(path, sizeof(path), "%s/enable", dir);
+    g_hwpwm_enable_fd = open(path, O_WRONLY | O_CLOEXEC);
+
+    if (g_hwpwm_duty_fd < 0 || g_hwpwm_enable_fd < 0) {
+        fprintf(stderr, "WARN: Cannot drive %s, using software PWM.\n", dir);
+        if (g_hwpwm_duty_fd >= 0) close(g_hwpwm_duty_fd);
+        if (g_hwpwm_enable_fd >= 0) close(g_hwpwm_enable_fd);
+        g_hwpwm_duty_fd = g_hwpwm_enable_fd = -1;
+        return;
+    }
+    printf("Rumble via hardware PWM %s.\n", dir);
+}
+
+static bool motor_has_hwpwm(void) {
+    return g_hwpwm_duty_fd >= 0;
+}
+
+// duty 为千分比, 只在变化时写 sysfs
+static void hwpwm_set_duty(uint32_t duty) {
+    if ((int)duty == g_hwpwm_last_duty) return;
+    char val[32];
+    int n = snprintf(val, sizeof(val), "%ld", g_hwpwm_period_ns / 1000 * duty);
+    write(g_hwpwm_duty_fd, val, n);
+    if ((duty == 0) != (g_hwpwm_last_duty <= 0))
+        write(g_hwpwm_enable_fd, duty ? "1" : "0", 1);
+    g_hwpwm_last_duty = (int)duty;
+}
+
+static void motor_init(void) {
+    hwpwm_init();
+    if (!motor_has_hwpwm()) gpio_init();
+}
+
+static void motor_off(void) {
+    if (motor_has_hwpwm()) hwpwm_set_duty(0);
+    else gpio_set(0);
+}
+
+// 空闲/挂起时交还 GPIO 线, 下次播放前用同一后端重新申请.
+// 硬件 PWM 在 duty 为 0 时已经关闭输出, 保持不动
+static void motor_release(void) {
+    motor_off();
+    if (g_gpio_fd >= 0) close(g_gpio_fd);
+    g_gpio_fd = -1;
+    g_gpio_last_state = -1;
+}
+
+static void motor_acquire(void) {
+    if (g_gpio_fd >= 0 || !g_gpio_backend) return;
+    g_gpio_fd = g_gpio_backend->open();
+}
+
+static void motor_close(void) {
+    motor_off();
+    if (g_hwpwm_duty_fd >= 0) close(g_hwpwm_duty_fd);
+    if (g_hwpwm_enable_fd >= 0) close(g_hwpwm_enable_fd);
+    if (g_gpio_fd >= 0) close(g_gpio_fd);
+    g_hwpwm_duty_fd = g_hwpwm_enable_fd = g_gpio_fd = -1;
+}
+
 /* ============================================================
  * 震动逻辑 (PWM 核心)
  * ============================================================ */
 #define RUMBLE_MAX_EFFECTS 16
+#define RUMBLE_ENVELOPE_STEP_MS 20   // 包络渐变期间重新混合的间隔 (一个 PWM 周期)
+#define RUMBLE_LUT_SIZE 256          // 按强度高 8 位查占空比
+#define RUMBLE_BUDGET_STEP_MS 250    // 持续震动时重新核算占空比预算的间隔
 
 typedef struct {
     struct ff_effect effect;
     bool in_use;
+    bool playing;          // 已触发 (可能还在 replay.delay 等待中)
+    int repeat;            // 剩余播放次数, 含本次
+    struct timespec start; // 本次播放开始时间 (已计入 delay)
+    struct timespec stop;  // 本次播放结束时间
 } rumble_slot_t;
 
 typedef struct {
     rumble_slot_t slots[RUMBLE_MAX_EFFECTS];
+    uint8_t playing[RUMBLE_MAX_EFFECTS]; // 正在播放的槽位, 混合只遍历这里
+    int n_playing;
+    uint32_t gain;         // FF_GAIN, 0..0xffff
+    uint32_t scale;        // 方案的震动强度 (Q8)
     
-    bool active;           // 是否处于震动状态
-    uint32_t magnitude;    // 当前震动总强度
-    struct timespec stop_time; // 预计停止时间
+    bool active;           // 是否有效果在播放或等待
+    bool dirty;            // 效果有变化, 下次 tick 立即重新混合
+    uint32_t magnitude;    // 混合后的震动总强度
+    struct timespec mix_at; // 下一次需要重新混合的时间 (开始/停止/包络)
     
-    uint32_t pwm_counter;  // PWM 计数器
+    uint16_t duty_lut[RUMBLE_LUT_SIZE]; // 该马达的强度 -> 占空比 (千分比)
+    uint32_t duty;         // 占空比 (千分比)
+    bool kicking;          // 起震全速脉冲中, 到 kick_until 为止
+    struct timespec kick_until;
+    int64_t heat;          // 实际输出占空比的指数滑动平均 (千分比 Q10)
+    struct timespec heat_at;
+    bool derated;          // 超出预算, 占空比压到预算值
+    long on_ns;            // 每个周期的高电平时长
+    bool pwm_on;           // 当前脉冲相位
+    struct timespec period_start; // 当前 PWM 周期起点
+    struct timespec next_edge;    // 下一次脉冲翻转时间
 } rumble_ctx_t;
 
+// 软件 PWM 时序与占空比预算, 启动时由配置换算好 (config_finalize), 震动路径只读这里
+typedef struct {
+    long period_ns;
+    long min_pulse_ns;
+    uint32_t budget;       // 平均占空比上限 (千分比), 0 表示不限
+    int64_t window_ms;     // 滑动平均的时间常数
+} pwm_timing_t;
+
+static pwm_timing_t g_pwm = { 1000000000L / PWM_CARRIER_HZ, PWM_MIN_PULSE_US * 1000L,
+                              RUMBLE_BUDGET_PCT * 10, RUMBLE_BUDGET_WINDOW_S * 1000L };
+
+// 基准测试用虚拟时钟; 正常运行时为 NULL
+static const struct timespec *g_clock_override;
+
 static void timespec_now(struct timespec *ts) {
+    if (g_clock_override) {
+        *ts = *g_clock_override;
+        return;
+    }
     clock_gettime(CLOCK_MONOTONIC, ts);
 }
 
@@ -97,249 +630,4427 @@ static void timespec_add_ms(struct timespec *ts, unsigned int ms) {
     }
 }
 
-static bool timespec_passed(const struct timespec *stop_at) {
+static void timespec_add_ns(struct timespec *ts, long ns) {
+    ts->tv_nsec += ns;
+    while (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec)
+        return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+static bool timespec_passed(const struct timespec *stop_at, const struct timespec *now) {
+    return timespec_cmp(now, stop_at) >= 0;
+}
+
+static int64_t timespec_diff_ms(const struct timespec *a, const struct timespec *b) {
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+static const struct timespec *timespec_min(const struct timespec *a, const struct timespec *b) {
+    return timespec_cmp(a, b) <= 0 ? a : b;
+}
+
+// 死区以下为 0, 满速阈值以上为上限, 中间从起转占空比按 gamma 曲线升到上限
+static void rumble_curve_build(uint16_t *lut) {
+    for (int i = 0; i < RUMBLE_LUT_SIZE; i++) {
+        int mag = i * 0xffff / (RUMBLE_LUT_SIZE - 1);
+        if (mag < g_cfg.rumble_deadzone) {
+            lut[i] = 0;
+        } else if (mag >= g_cfg.rumble_full) {
+            lut[i] = (uint16_t)g_cfg.rumble_max_duty;
+        } else {
+            double x = (double)(mag - g_cfg.rumble_deadzone) / (g_cfg.rumble_full - g_cfg.rumble_deadzone);
+            lut[i] = (uint16_t)(g_cfg.rumble_min_duty +
+                                (g_cfg.rumble_max_duty - g_cfg.rumble_min_duty) * pow(x, g_cfg.rumble_gamma) + 0.5);
+        }
+    }
+}
+
+static void rumble_init(rumble_ctx_t *ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->gain = 0xffff;
+    ctx->scale = 256;
+    rumble_curve_build(ctx->duty_lut);
+}
+
+// 单马达能近似的效果: 都折算成一个强度值
+static bool rumble_effect_supported(int type) {
+    return type == FF_RUMBLE || type == FF_CONSTANT || type == FF_PERIODIC;
+}
+
+// 为上传的效果确定槽位: id < 0 时取第一个空槽
+static int rumble_pick_slot(uint32_t used, int id) {
+    if (id >= RUMBLE_MAX_EFFECTS) return -EINVAL;
+    if (id >= 0) return id;
+    if (used == (1U << RUMBLE_MAX_EFFECTS) - 1) return -ENOSPC;
+    return __builtin_ctz(~used);
+}
+
+// 按 replay 参数安排一次播放: delay 之后开始, 持续 length (0 或过长时取安全上限)
+static void rumble_schedule(rumble_slot_t *slot, const struct timespec *from) {
+    unsigned int dur = slot->effect.replay.length;
+    if (dur == 0 || dur > (unsigned int)g_cfg.rumble_timeout_ms) dur = (unsigned int)g_cfg.rumble_timeout_ms;
+    slot->start = *from;
+    timespec_add_ms(&slot->start, slot->effect.replay.delay);
+    slot->stop = slot->start;
+    timespec_add_ms(&slot->stop, dur);
+}
+
+static void rumble_start_slot(rumble_ctx_t *ctx, int id, int count) {
+    rumble_slot_t *slot = &ctx->slots[id];
     struct timespec now;
     timespec_now(&now);
-    if (now.tv_sec != stop_at->tv_sec)
-        return now.tv_sec > stop_at->tv_sec;
-    return now.tv_nsec >= stop_at->tv_nsec;
+    if (!slot->playing) {
+        slot->playing = true;
+        ctx->playing[ctx->n_playing++] = (uint8_t)id;
+    }
+    slot->repeat = count;
+    rumble_schedule(slot, &now);
+    ctx->dirty = true;
+}
+
+static void rumble_stop_slot(rumble_ctx_t *ctx, int id) {
+    rumble_slot_t *slot = &ctx->slots[id];
+    if (!slot->playing) return;
+    slot->playing = false;
+    for (int i = 0; i < ctx->n_playing; i++) {
+        if (ctx->playing[i] == id) {
+            ctx->playing[i] = ctx->playing[--ctx->n_playing];
+            break;
+        }
+    }
+    ctx->dirty = true;
+}
+
+static void rumble_stop_all(rumble_ctx_t *ctx) {
+    while (ctx->n_playing > 0) rumble_stop_slot(ctx, ctx->playing[0]);
 }
 
 static int rumble_upload(rumble_ctx_t *ctx, struct ff_effect *eff) {
-    if (eff->type != FF_RUMBLE) return 0;
-    int id = eff->id;
-    if (id < 0) {
-        for (int i = 0; i < RUMBLE_MAX_EFFECTS; i++) {
-            if (!ctx->slots[i].in_use) { id = i; break; }
-        }
-        if (id < 0) return -ENOSPC;
-    } else if (id >= RUMBLE_MAX_EFFECTS) return -EINVAL;
-
-    ctx->slots[id].in_use = true;
-    ctx->slots[id].effect = *eff;
-    ctx->slots[id].effect.id = id;
+    if (!rumble_effect_supported(eff->type)) return 0;
+    uint32_t used = 0;
+    for (int i = 0; i < RUMBLE_MAX_EFFECTS; i++)
+        if (ctx->slots[i].in_use) used |= 1U << i;
+    int id = rumble_pick_slot(used, eff->id);
+    if (id < 0) return id;
+
+    rumble_slot_t *slot = &ctx->slots[id];
+    slot->in_use = true;
+    slot->effect = *eff;
+    slot->effect.id = id;
     eff->id = id;
+
+    // 播放中更新参数: 与内核 ff-memless 一样按新参数重新计时
+    if (slot->playing) {
+        struct timespec now;
+        timespec_now(&now);
+        rumble_schedule(slot, &now);
+        ctx->dirty = true;
+    }
     return 0;
 }
 
 static int rumble_erase(rumble_ctx_t *ctx, int id) {
     if (id >= 0 && id < RUMBLE_MAX_EFFECTS) {
+        rumble_stop_slot(ctx, id);
         ctx->slots[id].in_use = false;
-        ctx->active = false;
-        gpio_set(0);
     }
     return 0;
 }
 
 static void rumble_play(rumble_ctx_t *ctx, int id, int val) {
-    if (val == 0) {
-        ctx->active = false;
-        gpio_set(0);
-        return;
-    }
     if (id < 0 || id >= RUMBLE_MAX_EFFECTS || !ctx->slots[id].in_use) return;
+    if (val == 0) rumble_stop_slot(ctx, id);
+    else rumble_start_slot(ctx, id, val);
+}
 
-    struct ff_effect *e = &ctx->slots[id].effect;
-    
-    uint32_t mag = e->u.rumble.strong_magnitude + e->u.rumble.weak_magnitude;
-    if (mag < RUMBLE_DEADZONE) {
-        ctx->active = false;
-        gpio_set(0);
-        return;
+static void rumble_set_gain(rumble_ctx_t *ctx, int gain) {
+    ctx->gain = gain < 0 ? 0 : gain > 0xffff ? 0xffff : (uint32_t)gain;
+    ctx->dirty = true;
+}
+
+static void rumble_set_scale(rumble_ctx_t *ctx, int scale) {
+    ctx->scale = scale < 0 ? 0 : (uint32_t)scale;
+    ctx->dirty = true;
+}
+
+// 包络: 与内核 ff-memless 相同的线性插值; 处于渐变段时置 ramping
+static uint32_t rumble_envelope(const rumble_slot_t *slot, const struct ff_envelope *env,
+                                int level, const struct timespec *now, bool *ramping) {
+    int64_t since = timespec_diff_ms(now, &slot->start);
+    int64_t until = timespec_diff_ms(&slot->stop, now);
+
+    if (env->attack_length && since < env->attack_length) {
+        *ramping = true;
+        return env->attack_level + (level - env->attack_level) * since / env->attack_length;
+    }
+    if (env->fade_length && slot->effect.replay.length && until < env->fade_length) {
+        *ramping = true;
+        return env->fade_level + (level - env->fade_level) * until / env->fade_length;
+    }
+    return level;
+}
+
+// 单个效果在 now 时刻的强度, 统一到 0..0xffff 的量级
+static uint32_t rumble_slot_level(const rumble_slot_t *slot, const struct timespec *now, bool *ramping) {
+    const struct ff_effect *e = &slot->effect;
+    switch (e->type) {
+    case FF_RUMBLE:
+        return (e->u.rumble.strong_magnitude * (uint32_t)g_cfg.rumble_weight[0] +
+                e->u.rumble.weak_magnitude * (uint32_t)g_cfg.rumble_weight[1]) >> 8;
+    case FF_CONSTANT:
+        return 2 * rumble_envelope(slot, &e->u.constant.envelope,
+                                   abs(e->u.constant.level), now, ramping);
+    case FF_PERIODIC:
+        // 单马达无法表现波形, 只取幅度
+        return 2 * rumble_envelope(slot, &e->u.periodic.envelope,
+                                   abs(e->u.periodic.magnitude), now, ramping);
     }
+    return 0;
+}
 
-    ctx->magnitude = mag;
-    unsigned int dur = e->replay.length;
-    if (dur == 0 || dur > SAFETY_TIMEOUT_MS) dur = SAFETY_TIMEOUT_MS;
+// 混合所有播放中的效果: 饱和相加后乘以全局增益, 同时求出下一次变化时间
+static void rumble_mix(rumble_ctx_t *ctx, const struct timespec *now) {
+    uint32_t sum = 0;
+    bool ramping = false;
+    bool have_next = false;
+    struct timespec next = {0};
 
-    timespec_now(&ctx->stop_time);
-    timespec_add_ms(&ctx->stop_time, dur);
-    
-    ctx->active = true;
+    for (int i = 0; i < ctx->n_playing; ) {
+        rumble_slot_t *slot = &ctx->slots[ctx->playing[i]];
+        if (timespec_passed(&slot->stop, now)) {
+            if (slot->repeat > 1) {
+                // 下一次重复; 落后太多时从当前时间重新开始, 避免追赶
+                slot->repeat--;
+                struct timespec from = slot->stop;
+                rumble_schedule(slot, &from);
+                if (timespec_passed(&slot->stop, now)) rumble_schedule(slot, now);
+                continue;
+            }
+            rumble_stop_slot(ctx, ctx->playing[i]);
+            continue;
+        }
+
+        const struct timespec *edge = &slot->stop;
+        if (!timespec_passed(&slot->start, now)) edge = &slot->start;
+        else sum += rumble_slot_level(slot, now, &ramping);
+        if (!have_next || timespec_cmp(edge, &next) < 0) next = *edge;
+        have_next = true;
+        i++;
+    }
+
+    if (ramping) {
+        struct timespec step = *now;
+        timespec_add_ms(&step, RUMBLE_ENVELOPE_STEP_MS);
+        next = *timespec_min(&next, &step);
+    }
+    if (sum > 0xffff) sum = 0xffff;
+    ctx->magnitude = sum * ctx->gain / 0xffff;
+    ctx->mix_at = next;
+    ctx->active = ctx->n_playing > 0;
+    ctx->dirty = false;
+}
+
+// 强度 -> 占空比: 查表, 方案放大后超过满量程的按满量程算
+static inline uint32_t rumble_duty(const rumble_ctx_t *ctx, uint32_t mag) {
+    return ctx->duty_lut[(mag > 0xffff ? 0xffff : mag) >> 8];
 }
 
-// 模拟 PWM 的心跳函数
-static void rumble_tick(rumble_ctx_t *ctx) {
+// 把上次核算以来按当前占空比输出的时间计入滑动平均和马达运行时间.
+// 核算间隔远小于窗口, 用一阶近似 heat += (duty - heat) * dt / window 代替 exp
+static void rumble_budget_charge(rumble_ctx_t *ctx, const struct timespec *now) {
+    int64_t dt = timespec_diff_ms(now, &ctx->heat_at);
+    ctx->heat_at = *now;
+    if (dt <= 0) return;
+    if (ctx->duty) STAT_ADD(motor_on_us, (uint64_t)ctx->duty * (uint64_t)dt);   // 千分比 x ms
+    if (!g_pwm.budget) return;
+    int64_t target = (int64_t)ctx->duty << 10;
+    if (dt >= g_pwm.window_ms) ctx->heat = target;
+    else ctx->heat += (target - ctx->heat) * dt / g_pwm.window_ms;
+}
+
+// 超出预算后占空比不超过预算值, 长时间看平均输出正好等于预算;
+// 回落到预算的 90% 以下才解除, 避免在边界上来回切换
+static uint32_t rumble_budget_limit(rumble_ctx_t *ctx, uint32_t duty) {
+    if (!g_pwm.budget) return duty;
+    int64_t budget = (int64_t)g_pwm.budget << 10;
+    if (ctx->heat > budget) ctx->derated = true;
+    else if (ctx->heat < budget * 9 / 10) ctx->derated = false;
+    return ctx->derated && duty > g_pwm.budget ? g_pwm.budget : duty;
+}
+
+static void rumble_set_duty(rumble_ctx_t *ctx, uint32_t duty) {
+    long on_ns = g_pwm.period_ns / 1000 * duty;
+    if (on_ns < g_pwm.min_pulse_ns) on_ns = g_pwm.min_pulse_ns;
+    if (g_pwm.period_ns - on_ns < g_pwm.min_pulse_ns) duty = 1000;
+    ctx->duty = duty;
+    ctx->on_ns = on_ns;
+}
+
+// PWM 状态机: 只在边沿和效果变化时被调用, 返回下一次需要唤醒的时间
+static bool rumble_tick(rumble_ctx_t *ctx, const struct timespec *now, struct timespec *wake) {
+    if (ctx->dirty || (ctx->active && timespec_passed(&ctx->mix_at, now))) {
+        bool was_off = ctx->duty == 0;
+        rumble_budget_charge(ctx, now);
+        rumble_mix(ctx, now);
+        uint32_t duty = rumble_duty(ctx, (uint32_t)((uint64_t)ctx->magnitude * ctx->scale >> 8));
+        rumble_set_duty(ctx, rumble_budget_limit(ctx, duty));
+        if (g_pwm.budget && ctx->duty > 0) {
+            // 游戏反复重新触发的长震动没有混合点, 定期核算预算
+            struct timespec step = *now;
+            timespec_add_ms(&step, RUMBLE_BUDGET_STEP_MS);
+            ctx->mix_at = *timespec_min(&ctx->mix_at, &step);
+        }
+        if (was_off && ctx->duty > 0) {
+            // 从静止开始震动: 从一个完整周期开始; 震动中改强度则保持相位
+            ctx->pwm_on = false;
+            ctx->next_edge = *now;
+            // 低占空比时马达起转慢, 先全速一小段
+            ctx->kicking = g_cfg.rumble_kick_ms > 0 && ctx->duty < 1000;
+            ctx->kick_until = *now;
+            timespec_add_ms(&ctx->kick_until, (unsigned int)g_cfg.rumble_kick_ms);
+        }
+    }
+
     if (!ctx->active) {
-        gpio_set(0);
-        return;
+        ctx->kicking = false;
+        motor_off();
+        return false;
     }
 
-    if (timespec_passed(&ctx->stop_time)) {
-        ctx->active = false;
-        gpio_set(0);
-        return;
+    if (ctx->duty == 0) {
+        // 效果在 delay 等待中或强度低于死区
+        ctx->kicking = false;
+        motor_off();
+        *wake = ctx->mix_at;
+        return true;
+    }
+
+    if (ctx->kicking) {
+        if (!timespec_passed(&ctx->kick_until, now)) {
+            if (motor_has_hwpwm()) hwpwm_set_duty(1000);
+            else gpio_set(1);
+            *wake = *timespec_min(&ctx->kick_until, &ctx->mix_at);
+            return true;
+        }
+        // 脉冲结束, 从新周期开始正常 PWM
+        ctx->kicking = false;
+        ctx->pwm_on = false;
+        ctx->next_edge = *now;
+    }
+
+    if (motor_has_hwpwm()) {
+        // 硬件 PWM: 占空比只在变化时写入, 之后零 CPU
+        hwpwm_set_duty(ctx->duty);
+        *wake = ctx->mix_at;
+        return true;
     }
 
-    // PWM 逻辑
-    if (ctx->magnitude >= PWM_THRESHOLD) {
-        // 强震：全速
+    if (ctx->duty >= 1000) {
+        // 强震：全速, 只需等下一次混合
         gpio_set(1);
-    } else {
-        // 弱震：脉冲 (50% 占空比, 25Hz)
-        ctx->pwm_counter++;
-        if ((ctx->pwm_counter % 4) < 2) {
-            gpio_set(1);
+        ctx->pwm_on = false;
+        ctx->next_edge = *now;
+        *wake = ctx->mix_at;
+        return true;
+    }
+
+    if (timespec_passed(&ctx->next_edge, now)) {
+        if (ctx->pwm_on) {
+            // 下降沿, 等到下一个周期开始
+            ctx->pwm_on = false;
+            motor_off();
+            ctx->next_edge = ctx->period_start;
+            timespec_add_ns(&ctx->next_edge, g_pwm.period_ns);
         } else {
-            gpio_set(0);
+            // 上升沿; 以上一周期为基准累加避免漂移, 落后超过一个周期时以当前时间为准
+            struct timespec late = ctx->next_edge;
+            timespec_add_ns(&late, g_pwm.period_ns);
+            ctx->period_start = timespec_passed(&late, now) ? *now : ctx->next_edge;
+            ctx->pwm_on = true;
+            gpio_set(1);
+            ctx->next_edge = ctx->period_start;
+            timespec_add_ns(&ctx->next_edge, ctx->on_ns);
         }
     }
+    *wake = *timespec_min(&ctx->next_edge, &ctx->mix_at);
+    return true;
 }
 
 /* ============================================================
- * uinput 虚拟设备
+ * 定时调度 (timerfd, 只在有任务时才设定)
  * ============================================================ */
-static void setup_abs(int fd, int code, int min, int max, int fuzz, int flat) {
-    struct uinput_abs_setup abs = {0};
-    abs.code = code;
-    abs.absinfo.minimum = min;
-    abs.absinfo.maximum = max;
-    abs.absinfo.fuzz = fuzz;
-    abs.absinfo.flat = flat;
-    ioctl(fd, UI_ABS_SETUP, &abs);
-}
-
-static int create_virtual_pad(void) {
-    int fd = open("/dev/uinput", O_RDWR | O_NONBLOCK);
-    if (fd < 0) return -1;
+// 每个虚拟手柄的输出批各有一组, 编号为 fwd_sink_t.timer 加上这里的偏移
+enum {
+    TIMER_MACRO,
+    TIMER_FLUSH,     // 积压的输出写不进去时隔一会儿重试
+    TIMER_ABS,       // 限速期间攒下的轴值到点输出
+    TIMER_PAD_SLOTS
+};
 
-    ioctl(fd, UI_SET_EVBIT, EV_KEY);
-    ioctl(fd, UI_SET_EVBIT, EV_ABS);
-    ioctl(fd, UI_SET_EVBIT, EV_FF);
-    ioctl(fd, UI_SET_EVBIT, EV_SW); // 加上 SW
-
-    // 按键定义 (匹配原厂)
-    int keys[] = {304,305,307,308, 310,311, 314,315, 316, 317,318};
-    for (int i=0; i < sizeof(keys)/sizeof(int); i++) 
-        ioctl(fd, UI_SET_KEYBIT, keys[i]);
+enum {
+    TIMER_RUMBLE,
+    TIMER_IDLE,
+    TIMER_PAD,       // 第一个虚拟手柄的那组
+    TIMER_COUNT = TIMER_PAD + PAD_MAX * TIMER_PAD_SLOTS
+};
 
-    // 轴定义
-    int axes[] = {ABS_X, ABS_Y, ABS_Z, ABS_RX, ABS_RY, ABS_RZ, ABS_HAT0X, ABS_HAT0Y};
-    for (int i=0; i < sizeof(axes)/sizeof(int); i++) 
-        ioctl(fd, UI_SET_ABSBIT, axes[i]);
+static int g_timer_fd = -1;
+static bool g_timer_armed[TIMER_COUNT];
+static struct timespec g_timer_due[TIMER_COUNT];
+static struct timespec g_timer_programmed;   // 当前写入 timerfd 的时间, 0 表示未设定
 
-    ioctl(fd, UI_SET_FFBIT, FF_RUMBLE);
-    ioctl(fd, UI_SET_FFBIT, FF_GAIN);
-    ioctl(fd, UI_SET_SWBIT, SW_TABLET_MODE);
+static int timer_init(void) {
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return g_timer_fd;
+}
 
-    struct uinput_setup setup = {0};
-    strncpy(setup.name, DEVICE_NAME, sizeof(setup.name) - 1);
-    setup.id.bustype = BUS_USB;
-    setup.id.vendor  = DEVICE_VENDOR;
-    setup.id.product = DEVICE_PRODUCT;
-    setup.id.version = DEVICE_VERSION;
-    setup.ff_effects_max = RUMBLE_MAX_EFFECTS;
+static void timer_set(int id, const struct timespec *due) {
+    g_timer_armed[id] = true;
+    g_timer_due[id] = *due;
+}
 
-    ioctl(fd, UI_DEV_SETUP, &setup);
+static void timer_clear(int id) {
+    g_timer_armed[id] = false;
+}
 
-    // 轴参数 (精确匹配原厂)
-    setup_abs(fd, ABS_X, -32767, 32767, 0, 0);
-    setup_abs(fd, ABS_Y, -32767, 32767, 0, 0);
-    setup_abs(fd, ABS_RX,-32767, 32767, 0, 0);
-    setup_abs(fd, ABS_RY,-32767, 32767, 0, 0);
-    setup_abs(fd, ABS_Z, 0, 255, 0, 0);
-    setup_abs(fd, ABS_RZ,0, 255, 0, 0);
-    setup_abs(fd, ABS_HAT0X,-1, 1, 0, 0);
-    setup_abs(fd, ABS_HAT0Y,-1, 1, 0, 0);
+static bool timer_due(int id, const struct timespec *now) {
+    return g_timer_armed[id] && timespec_passed(&g_timer_due[id], now);
+}
 
-    if (ioctl(fd, UI_DEV_CREATE) < 0) {
-        close(fd);
-        return -1;
+// 把最早的到期时间写入 timerfd; 没有任务时停掉定时器, poll 可以一直阻塞
+static void timer_commit(void) {
+    struct itimerspec its = {0};
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        if (!g_timer_armed[i]) continue;
+        if ((its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) ||
+            timespec_cmp(&g_timer_due[i], &its.it_value) < 0)
+            its.it_value = g_timer_due[i];
     }
-    return fd;
+    if (timespec_cmp(&its.it_value, &g_timer_programmed) == 0) return;
+    g_timer_programmed = its.it_value;
+    timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
-static void handle_signal(int sig) {
-    (void)sig;
-    keep_running = 0;
+// 一次性定时器触发后内核已自动停表, 下次 commit 需要重新写入
+static void timer_ack(void) {
+    uint64_t expirations;
+    read(g_timer_fd, &expirations, sizeof(expirations));
+    memset(&g_timer_programmed, 0, sizeof(g_timer_programmed));
 }
 
-int main(void) {
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
-    
-    gpio_init();
-    rumble_ctx_t rumble = {0};
+static void rumble_service(rumble_ctx_t *ctx) {
+    struct timespec now, wake;
+    timespec_now(&now);
+    if (rumble_tick(ctx, &now, &wake)) timer_set(TIMER_RUMBLE, &wake);
+    else timer_clear(TIMER_RUMBLE);
+}
 
-    // 1. 打开被脚本隐藏的真实设备
-    int src_fd = open(REAL_DEV_PATH, O_RDONLY | O_NONBLOCK);
-    if (src_fd < 0) {
-        fprintf(stderr, "FATAL: Cannot open %s. Please run start_proxy.sh first!\n", REAL_DEV_PATH);
-        return 1;
-    }
-    
-    // 2. 依然执行 Grab，防止意外泄漏
-    ioctl(src_fd, EVIOCGRAB, 1);
+/* ============================================================
+ * 事件录制 (--record) 与回放 (--replay)
+ * ============================================================ */
+// 文件 = 头部 + 预分配的 mmap 环; 写满后覆盖最旧的记录, 热路径只有内存写入.
+// 每条记录: [总长 u8][类型 u8][varint 距上一条的微秒数][内容], 长度 0 表示绕回
+#define REC_MAGIC     "TRIMREC1"
+#define REC_CAPACITY  (4 * 1024 * 1024)
+#define REC_MAX       80
 
-    // 3. 创建虚拟设备
-    int virt_fd = create_virtual_pad();
-    if (virt_fd < 0) {
-        perror("Virtual creation failed");
-        ioctl(src_fd, EVIOCGRAB, 0);
-        close(src_fd);
-        return 1;
-    }
+enum {
+    REC_EVENT = 1,   // 内容: type u8, varint code, zigzag value
+    REC_FF    = 2,   // 内容: op u8, zigzag id, zigzag value, UPLOAD 时附 struct ff_effect
+};
 
-    struct pollfd fds[2] = {
-        { src_fd, POLLIN, 0 },
-        { virt_fd, POLLIN, 0 }
-    };
-    
-    printf("Proxy started. Reading %s, Outputting Virtual Pad with PWM Rumble.\n", REAL_DEV_PATH);
+typedef struct {
+    char magic[8];
+    uint32_t capacity;     // 数据区字节数
+    uint32_t head;         // 下一条写入位置
+    uint32_t tail;         // 最旧一条记录的位置
+    uint32_t count;        // 环内记录数
+    uint64_t total;        // 累计写入 (含被覆盖的)
+    int64_t  last_us;      // 最后一条记录的时间 (CLOCK_MONOTONIC)
+} rec_header_t;
 
-    while (keep_running) {
-        // 10ms 轮询周期，配合 PWM 逻辑
-        if (poll(fds, 2, 10) < 0) {
-            if (errno == EINTR) continue;
-            break;
-        }
+typedef struct {
+    rec_header_t *hdr;
+    uint8_t *data;
+    size_t map_len;
+} rec_file_t;
 
-        // 处理来自模拟器的震动指令
-        if (fds[1].revents & POLLIN) {
-            struct input_event ev;
-            while (read(virt_fd, &ev, sizeof(ev)) == sizeof(ev)) {
-                if (ev.type == EV_UINPUT) {
-                    if (ev.code == UI_FF_UPLOAD) {
-                        struct uinput_ff_upload up; up.request_id = ev.value;
-                        if (ioctl(virt_fd, UI_BEGIN_FF_UPLOAD, &up) >= 0) {
-                            rumble_upload(&rumble, &up.effect);
-                            up.retval = 0;
-                            ioctl(virt_fd, UI_END_FF_UPLOAD, &up);
-                        }
-                    } else if (ev.code == UI_FF_ERASE) {
-                        struct uinput_ff_erase er; er.request_id = ev.value;
-                        if (ioctl(virt_fd, UI_BEGIN_FF_ERASE, &er) >= 0) {
-                            rumble_erase(&rumble, er.effect_id);
-                            ioctl(virt_fd, UI_END_FF_ERASE, &er);
-                        }
-                    }
-                } else if (ev.type == EV_FF && ev.code != FF_GAIN) {
-                    rumble_play(&rumble, ev.code, ev.value);
-                }
-            }
-        }
+static rec_file_t g_rec;
 
-        // 转发真实按键
-        if (fds[0].revents & POLLIN) {
-            struct input_event ev;
-            while (read(src_fd, &ev, sizeof(ev)) == sizeof(ev)) {
-                write(virt_fd, &ev, sizeof(ev));
-            }
-        }
+static size_t rec_put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
 
-        // 更新 PWM 震动状态
-        rumble_tick(&rumble);
+static size_t rec_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    size_t n = 0;
+    int shift = 0;
+    *v = 0;
+    while (p + n < end && shift < 64) {
+        uint8_t b = p[n++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return n;
+        shift += 7;
     }
+    return 0;
+}
 
-    // 清理
-    gpio_set(0);
-    if (g_gpio_fd >= 0) close(g_gpio_fd);
-    
+static uint64_t rec_zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t rec_unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static void rec_drop_oldest(rec_header_t *h, const uint8_t *data) {
+    if (h->tail >= h->capacity || data[h->tail] == 0) {
+        h->tail = 0;   // 绕回标记, 不是记录
+        return;
+    }
+    h->tail += data[h->tail];
+    h->count--;
+}
+
+// 在 head 处腾出 n 字节的连续空间, 必要时绕回并丢弃最旧的记录
+static uint8_t *rec_reserve(uint32_t n) {
+    rec_header_t *h = g_rec.hdr;
+    if (h->capacity - h->head < n) {
+        while (h->count > 0 && h->tail > h->head) rec_drop_oldest(h, g_rec.data);
+        if (h->head < h->capacity) g_rec.data[h->head] = 0;
+        h->head = 0;
+    }
+    while (h->count > 0 && h->tail >= h->head && h->tail - h->head <= n)
+        rec_drop_oldest(h, g_rec.data);
+    if (h->count == 0) h->tail = h->head;
+    return &g_rec.data[h->head];
+}
+
+static void rec_commit(const uint8_t *rec, uint32_t n) {
+    rec_header_t *h = g_rec.hdr;
+    memcpy(rec_reserve(n), rec, n);
+    h->head += n;
+    h->count++;
+    h->total++;
+}
+
+// 组装记录头, 返回已写入的长度; 时间不回退
+static size_t rec_begin(uint8_t *buf, int kind, int64_t t_us) {
+    int64_t dt = t_us - g_rec.hdr->last_us;
+    if (dt < 0 || g_rec.hdr->total == 0) dt = 0;
+    if (t_us > g_rec.hdr->last_us) g_rec.hdr->last_us = t_us;
+    buf[1] = (uint8_t)kind;
+    return 2 + rec_put_varint(buf + 2, (uint64_t)dt);
+}
+
+static int64_t rec_now_us(void) {
+    struct timespec now;
+    timespec_now(&now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void rec_events(const struct input_event *evs, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        const struct input_event *ev = &evs[i];
+        int64_t t = g_rec.hdr->last_us;
+        if (ev->input_event_sec || ev->input_event_usec)
+            t = (int64_t)ev->input_event_sec * 1000000 + ev->input_event_usec;
+
+        uint8_t buf[REC_MAX];
+        size_t len = rec_begin(buf, REC_EVENT, t);
+        buf[len++] = (uint8_t)ev->type;
+        len += rec_put_varint(buf + len, ev->code);
+        len += rec_put_varint(buf + len, rec_zigzag(ev->value));
+        buf[0] = (uint8_t)len;
+        rec_commit(buf, (uint32_t)len);
+    }
+}
+
+static void rec_ff(int op, int id, int value, const struct ff_effect *eff) {
+    uint8_t buf[REC_MAX];
+    size_t len = rec_begin(buf, REC_FF, rec_now_us());
+    buf[len++] = (uint8_t)op;
+    len += rec_put_varint(buf + len, rec_zigzag(id));
+    len += rec_put_varint(buf + len, rec_zigzag(value));
+    if (eff) {
+        memcpy(buf + len, eff, sizeof(*eff));
+        len += sizeof(*eff);
+    }
+    buf[0] = (uint8_t)len;
+    rec_commit(buf, (uint32_t)len);
+}
+
+static bool rec_enabled(void) {
+    return g_rec.hdr != NULL;
+}
+
+static int rec_map(const char *path, bool create) {
+    int fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+    if (fd < 0) return -1;
+
+    size_t len = sizeof(rec_header_t) + REC_CAPACITY;
+    if (create) {
+        // 预先分配好磁盘空间, 避免运行中 mmap 写入时因空间不足收到 SIGBUS
+        if (posix_fallocate(fd, 0, len) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size < (off_t)sizeof(rec_header_t)) {
+            close(fd);
+            return -1;
+        }
+        len = (size_t)size;
+    }
+
+    void *map = mmap(NULL, len, create ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                     MAP_SHARED | (create ? MAP_POPULATE : 0), fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    g_rec.hdr = map;
+    g_rec.data = (uint8_t *)map + sizeof(rec_header_t);
+    g_rec.map_len = len;
+    if (create) {
+        memcpy(g_rec.hdr->magic, REC_MAGIC, sizeof(g_rec.hdr->magic));
+        g_rec.hdr->capacity = REC_CAPACITY;
+    } else if (memcmp(g_rec.hdr->magic, REC_MAGIC, sizeof(g_rec.hdr->magic)) != 0 ||
+               g_rec.hdr->capacity > len - sizeof(rec_header_t)) {
+        munmap(map, len);
+        g_rec.hdr = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int rec_open(const char *path) {
+    if (rec_map(path, true) < 0) {
+        fprintf(stderr, "WARN: Cannot create record file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    printf("Recording to %s.\n", path);
+    return 0;
+}
+
+static void rec_close(void) {
+    if (!g_rec.hdr) return;
+    msync(g_rec.hdr, g_rec.map_len, MS_ASYNC);
+    munmap(g_rec.hdr, g_rec.map_len);
+    g_rec.hdr = NULL;
+}
+
+/* ============================================================
+ * 震动引擎: 内联执行, 或交给独立的 SCHED_FIFO 线程 (--rt-rumble)
+ * ============================================================ */
+#define RUMBLE_CMDQ_SIZE 64   // 必须是 2 的幂
+
+enum {
+    RUMBLE_CMD_UPLOAD,
+    RUMBLE_CMD_ERASE,
+    RUMBLE_CMD_PLAY,
+    RUMBLE_CMD_GAIN,
+    RUMBLE_CMD_SCALE,
+    RUMBLE_CMD_IDLE,      // 没有效果在播放时交还马达
+    RUMBLE_CMD_SUSPEND,   // 停掉所有效果并交还马达
+};
+
+typedef struct {
+    int op;
+    int id;
+    int value;
+    struct ff_effect effect;
+} rumble_cmd_t;
+
+// 单生产者 (主线程) / 单消费者 (震动线程) 无锁环
+typedef struct {
+    rumble_cmd_t q[RUMBLE_CMDQ_SIZE];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+} rumble_cmdq_t;
+
+static bool cmdq_push(rumble_cmdq_t *q, const rumble_cmd_t *cmd) {
+    uint32_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t t = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (h - t == RUMBLE_CMDQ_SIZE) return false;
+    q->q[h & (RUMBLE_CMDQ_SIZE - 1)] = *cmd;
+    atomic_store_explicit(&q->head, h + 1, memory_order_release);
+    return true;
+}
+
+static bool cmdq_pop(rumble_cmdq_t *q, rumble_cmd_t *cmd) {
+    uint32_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t h = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (h == t) return false;
+    *cmd = q->q[t & (RUMBLE_CMDQ_SIZE - 1)];
+    atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+    return true;
+}
+
+typedef struct {
+    rumble_ctx_t ctx;          // 线程模式下只由震动线程访问
+    bool threaded;
+    uint32_t slots_used;       // 线程模式: 主线程侧的槽位占用, upload 需要同步回复
+    rumble_cmdq_t cmdq;
+    int wake_fd;
+    int timer_fd;
+    atomic_bool stop;
+    pthread_t thread;
+} rumble_engine_t;
+
+static void rumble_apply(rumble_ctx_t *ctx, rumble_cmd_t *cmd) {
+    switch (cmd->op) {
+    case RUMBLE_CMD_UPLOAD: rumble_upload(ctx, &cmd->effect); break;
+    case RUMBLE_CMD_ERASE:  rumble_erase(ctx, cmd->id); break;
+    case RUMBLE_CMD_PLAY:
+        if (cmd->value) motor_acquire();
+        rumble_play(ctx, cmd->id, cmd->value);
+        break;
+    case RUMBLE_CMD_GAIN:   rumble_set_gain(ctx, cmd->value); break;
+    case RUMBLE_CMD_SCALE:  rumble_set_scale(ctx, cmd->value); break;
+    case RUMBLE_CMD_IDLE:
+        if (!ctx->active) motor_release();
+        break;
+    case RUMBLE_CMD_SUSPEND:
+        rumble_stop_all(ctx);
+        motor_release();
+        break;
+    }
+}
+
+static void *rumble_thread_main(void *arg) {
+    rumble_engine_t *eng = arg;
+    struct pollfd fds[2] = {
+        { eng->wake_fd, POLLIN, 0 },
+        { eng->timer_fd, POLLIN, 0 },
+    };
+
+    while (!atomic_load_explicit(&eng->stop, memory_order_acquire)) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+
+        uint64_t v;
+        if (fds[0].revents & POLLIN) read(eng->wake_fd, &v, sizeof(v));
+        if (fds[1].revents & POLLIN) read(eng->timer_fd, &v, sizeof(v));
+
+        rumble_cmd_t cmd;
+        while (cmdq_pop(&eng->cmdq, &cmd)) rumble_apply(&eng->ctx, &cmd);
+
+        struct timespec now;
+        struct itimerspec its = {0};
+        timespec_now(&now);
+        rumble_tick(&eng->ctx, &now, &its.it_value);   // 不需要唤醒时 its 为 0, 即停表
+        timerfd_settime(eng->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+    motor_off();
+    return NULL;
+}
+
+static int rumble_thread_pick_cpu(void) {
+    if (g_cfg.rt_cpu >= 0) return g_cfg.rt_cpu;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n - 1 : 0;
+}
+
+static int rumble_thread_start(rumble_engine_t *eng) {
+    eng->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    eng->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (eng->wake_fd < 0 || eng->timer_fd < 0) return -1;
+
+    // 信号只交给主线程处理
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pthread_attr_t attr;
+    struct sched_param sp = { .sched_priority = g_cfg.rt_prio };
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &sp);
+    int err = pthread_create(&eng->thread, &attr, rumble_thread_main, eng);
+    pthread_attr_destroy(&attr);
+    if (err == EPERM) {
+        fprintf(stderr, "WARN: SCHED_FIFO not permitted, rumble thread uses normal priority\n");
+        err = pthread_create(&eng->thread, NULL, rumble_thread_main, eng);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) return -1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(rumble_thread_pick_cpu(), &set);
+    if (pthread_setaffinity_np(eng->thread, sizeof(set), &set) != 0)
+        fprintf(stderr, "WARN: Cannot pin rumble thread to CPU %d\n", rumble_thread_pick_cpu());
+
+    eng->threaded = true;
+    return 0;
+}
+
+static void rumble_thread_stop(rumble_engine_t *eng) {
+    if (!eng->threaded) return;
+    uint64_t one = 1;
+    atomic_store_explicit(&eng->stop, true, memory_order_release);
+    write(eng->wake_fd, &one, sizeof(one));
+    pthread_join(eng->thread, NULL);
+    close(eng->wake_fd);
+    close(eng->timer_fd);
+    eng->threaded = false;
+}
+
+static int rumble_submit(rumble_engine_t *eng, rumble_cmd_t *cmd) {
+    if (!eng->threaded) {
+        rumble_apply(&eng->ctx, cmd);
+        rumble_service(&eng->ctx);
+        return 0;
+    }
+    if (!cmdq_push(&eng->cmdq, cmd)) return -EBUSY;
+    uint64_t one = 1;
+    write(eng->wake_fd, &one, sizeof(one));
+    return 0;
+}
+
+static int rumble_engine_upload(rumble_engine_t *eng, struct ff_effect *eff) {
+    int ret;
+    if (!eng->threaded) {
+        ret = rumble_upload(&eng->ctx, eff);
+        rumble_service(&eng->ctx);
+    } else if (!rumble_effect_supported(eff->type)) {
+        return 0;
+    } else {
+        int id = rumble_pick_slot(eng->slots_used, eff->id);
+        if (id < 0) return id;
+        eff->id = id;
+
+        rumble_cmd_t cmd = { .op = RUMBLE_CMD_UPLOAD, .id = id, .effect = *eff };
+        ret = rumble_submit(eng, &cmd);
+        if (ret == 0) eng->slots_used |= 1U << id;
+    }
+    if (ret == 0 && rec_enabled()) rec_ff(RUMBLE_CMD_UPLOAD, eff->id, 0, eff);
+    return ret;
+}
+
+static void rumble_engine_erase(rumble_engine_t *eng, int id) {
+    if (id >= 0 && id < RUMBLE_MAX_EFFECTS) eng->slots_used &= ~(1U << id);
+    rumble_cmd_t cmd = { .op = RUMBLE_CMD_ERASE, .id = id };
+    if (rec_enabled()) rec_ff(cmd.op, id, 0, NULL);
+    rumble_submit(eng, &cmd);
+}
+
+static void rumble_engine_play(rumble_engine_t *eng, int id, int value) {
+    rumble_cmd_t cmd = { .op = RUMBLE_CMD_PLAY, .id = id, .value = value };
+    if (rec_enabled()) rec_ff(cmd.op, id, value, NULL);
+    rumble_submit(eng, &cmd);
+}
+
+static void rumble_engine_gain(rumble_engine_t *eng, int gain) {
+    rumble_cmd_t cmd = { .op = RUMBLE_CMD_GAIN, .value = gain };
+    if (rec_enabled()) rec_ff(cmd.op, 0, gain, NULL);
+    rumble_submit(eng, &cmd);
+}
+
+// 方案切换带来的强度变化不属于游戏的 FF 指令, 不录制
+static void rumble_engine_scale(rumble_engine_t *eng, int scale) {
+    rumble_cmd_t cmd = { .op = RUMBLE_CMD_SCALE, .value = scale };
+    rumble_submit(eng, &cmd);
+}
+
+// 马达由执行震动的一方 (主线程或震动线程) 交还, 不与 PWM 抢 fd
+static void rumble_engine_release(rumble_engine_t *eng, bool suspend) {
+    rumble_cmd_t cmd = { .op = suspend ? RUMBLE_CMD_SUSPEND : RUMBLE_CMD_IDLE };
+    rumble_submit(eng, &cmd);
+}
+
+/* ============================================================
+ * 摇杆滤波: 校准/死区/迟滞, 全部定点查表, 只输出变化的值
+ * ============================================================ */
+#define FILTER_UNIT 32767   // 归一化量程
+
+_Static_assert(ABS_CNT == 64, "filter masks assume 64 axes");
+
+typedef struct {
+    int32_t in_center;     // 原始中心 (单边轴为最小值)
+    int32_t k_neg, k_pos;  // Q16: 原始偏移 -> 归一化
+    int32_t dz;            // 归一化死区
+    int32_t k_dz;          // Q16: 扣除死区后拉伸回满量程
+    int32_t out_base;      // 输出中心 (单边轴为最小值)
+    int32_t out_neg, out_pos; // 输出负/正半量程
+    int32_t hyst;
+    int8_t  pair;          // 径向死区的另一轴, -1 表示按单轴处理
+} axis_filter_t;
+
+typedef struct {
+    uint64_t mask;         // 启用滤波的轴
+    axis_filter_t axis[ABS_CNT];
+} filter_t;
+
+static int8_t abs_stick_pair(int code) {
+    switch (code) {
+    case ABS_X:  return ABS_Y;
+    case ABS_Y:  return ABS_X;
+    case ABS_RX: return ABS_RY;
+    case ABS_RY: return ABS_RX;
+    }
+    return -1;
+}
+
+static uint32_t isqrt32(uint32_t v) {
+    uint32_t r = 0, bit = 1U << 30;
+    while (bit > v) bit >>= 2;
+    while (bit) {
+        if (v >= r + bit) {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+// 输出轴的量程: 虚拟手柄声明过该轴就用它的, 否则与源轴相同
+static struct input_absinfo abs_out_range(const struct input_absinfo *pad_abs, int code,
+                                          const struct input_absinfo *src) {
+    if (pad_abs && pad_abs[code].maximum > pad_abs[code].minimum) return pad_abs[code];
+    return *src;
+}
+
+// 按用户参数和设备量程生成查表参数; 输入为真实设备的量程, 输出为虚拟手柄的量程
+static void filter_compile(filter_t *f, const axis_param_t *params, int src_fd,
+                           const struct input_absinfo *pad_abs) {
+    memset(f, 0, sizeof(*f));
+    for (int code = 0; code < ABS_CNT; code++) {
+        const axis_param_t *p = &params[code];
+        if (!p->enabled) continue;
+
+        struct input_absinfo ai;
+        if (ioctl(src_fd, EVIOCGABS(code), &ai) < 0 || ai.maximum <= ai.minimum) continue;
+
+        axis_filter_t *a = &f->axis[code];
+        int32_t lo = p->calibrated ? p->cal_min : ai.minimum;
+        int32_t hi = p->calibrated ? p->cal_max : ai.maximum;
+        bool centered = p->calibrated ? p->cal_center > lo : ai.minimum < 0;
+        int32_t center = !centered ? lo : p->calibrated ? p->cal_center : lo + (hi - lo) / 2;
+        if (hi <= center || (centered && center <= lo)) continue;
+
+        a->in_center = center;
+        a->k_neg = centered ? (int32_t)(((int64_t)FILTER_UNIT << 16) / (center - lo)) : 0;
+        a->k_pos = (int32_t)(((int64_t)FILTER_UNIT << 16) / (hi - center));
+        a->dz = p->deadzone * FILTER_UNIT / 1000;
+        if (a->dz >= FILTER_UNIT) a->dz = FILTER_UNIT - 1;
+        a->k_dz = (int32_t)(((int64_t)FILTER_UNIT << 16) / (FILTER_UNIT - a->dz));
+        struct input_absinfo out = abs_out_range(pad_abs, code, &ai);
+        a->out_base = centered ? out.minimum + (out.maximum - out.minimum) / 2 : out.minimum;
+        a->out_neg = a->out_base - out.minimum;
+        a->out_pos = out.maximum - a->out_base;
+        a->hyst = p->hysteresis;
+        a->pair = centered ? abs_stick_pair(code) : -1;
+        f->mask |= 1ULL << code;
+    }
+    // 只有两根轴都启用时才做径向死区
+    for (int code = 0; code < ABS_CNT; code++) {
+        axis_filter_t *a = &f->axis[code];
+        if (a->pair >= 0 && (!(f->mask >> a->pair & 1) || f->axis[a->pair].pair != code))
+            a->pair = -1;
+    }
+}
+
+static inline int32_t filter_clamp(int64_t v) {
+    return v > FILTER_UNIT ? FILTER_UNIT : v < -FILTER_UNIT ? -FILTER_UNIT : (int32_t)v;
+}
+
+static inline int32_t filter_norm(const axis_filter_t *a, int32_t v) {
+    int64_t d = (int64_t)v - a->in_center;
+    return filter_clamp((d * (d < 0 ? a->k_neg : a->k_pos)) >> 16);
+}
+
+static inline int32_t filter_denorm(const axis_filter_t *a, int32_t n) {
+    return a->out_base + (int32_t)((int64_t)n * (n < 0 ? a->out_neg : a->out_pos) / FILTER_UNIT);
+}
+
+static inline int32_t filter_axial(const axis_filter_t *a, int32_t n) {
+    int32_t m = n < 0 ? -n : n;
+    if (m <= a->dz) return 0;
+    int32_t s = (int32_t)(((int64_t)(m - a->dz) * a->k_dz) >> 16);
+    return n < 0 ? -filter_clamp(s) : filter_clamp(s);
+}
+
+// 径向死区: 半径在死区内归零, 之外按比例拉伸, 保持方向
+static void filter_radial(const axis_filter_t *a, int32_t *nx, int32_t *ny) {
+    uint32_t r = isqrt32((uint32_t)((int64_t)*nx * *nx + (int64_t)*ny * *ny));
+    if ((int32_t)r <= a->dz) {
+        *nx = *ny = 0;
+        return;
+    }
+    int64_t s = (int64_t)(r - a->dz) * a->k_dz;   // Q16 的新半径
+    int64_t div = (int64_t)r << 16;
+    *nx = filter_clamp(*nx * s / div);
+    *ny = filter_clamp(*ny * s / div);
+}
+
+static const struct {
+    const char *name;
+    int code;
+} g_abs_names[] = {
+    { "x", ABS_X }, { "y", ABS_Y }, { "z", ABS_Z },
+    { "rx", ABS_RX }, { "ry", ABS_RY }, { "rz", ABS_RZ },
+    { "hat0x", ABS_HAT0X }, { "hat0y", ABS_HAT0Y },
+};
+
+static int abs_code_from_name(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(g_abs_names) / sizeof(g_abs_names[0]); i++)
+        if (strlen(g_abs_names[i].name) == len && strncasecmp(name, g_abs_names[i].name, len) == 0)
+            return g_abs_names[i].code;
+    char *end;
+    long code = strtol(name, &end, 0);
+    return (end == name + len && code >= 0 && code < ABS_CNT) ? (int)code : -1;
+}
+
+// "DZ[,HYST[,MIN:CENTER:MAX]]"
+static int axis_param_parse(const char *spec, axis_param_t *p) {
+    axis_param_t a = { .enabled = true };
+    int n = sscanf(spec, "%d,%d,%d:%d:%d", &a.deadzone, &a.hysteresis,
+                   &a.cal_min, &a.cal_center, &a.cal_max);
+    if (n < 1 || n == 3 || n == 4 || a.deadzone < 0 || a.deadzone >= 1000 || a.hysteresis < 0)
+        return -1;
+    a.calibrated = n == 5;
+    *p = a;
+    return 0;
+}
+
+// "NAME=DZ[,HYST[,MIN:CENTER:MAX]]"
+static int axis_option_parse(const char *opt, axis_param_t *axis) {
+    const char *eq = strchr(opt, '=');
+    int code = eq ? abs_code_from_name(opt, eq - opt) : -1;
+    if (code < 0) return -1;
+    return axis_param_parse(eq + 1, &axis[code]);
+}
+
+// --filter / 方案文件的 filter: 两个摇杆的四根轴用同一组参数
+static int stick_filter_parse(const char *spec, axis_param_t *axis) {
+    static const int sticks[] = { ABS_X, ABS_Y, ABS_RX, ABS_RY };
+    for (int i = 0; i < 4; i++)
+        if (axis_param_parse(spec, &axis[sticks[i]]) < 0) return -1;
+    return 0;
+}
+
+/* ============================================================
+ * 按键/轴重映射: 启动时生成 (type, code) 平铺查表, 每个事件一次数组访问
+ * ============================================================ */
+#define REMAP_SLOTS (KEY_CNT + ABS_CNT)
+
+enum {
+    REMAP_INVERT = 1 << 0,   // 轴反向: 输出 param - v, param 为 min + max
+    REMAP_TO_KEY = 1 << 1,   // 轴转按键: v >= param 为按下
+};
+
+typedef struct {
+    uint16_t type;           // 输出类型, 0 表示丢弃
+    uint16_t code;
+    uint16_t flags;
+    int32_t  param;
+} remap_entry_t;
+
+typedef struct {
+    bool active;             // 没有任何规则时整段跳过
+    remap_entry_t map[REMAP_SLOTS];
+} remap_t;
+
+static inline int remap_index(int type, int code) {
+    if (type == EV_KEY && code < KEY_CNT) return code;
+    if (type == EV_ABS && code < ABS_CNT) return KEY_CNT + code;
+    return -1;
+}
+
+static void remap_reset(remap_t *r) {
+    r->active = false;
+    for (int code = 0; code < KEY_CNT; code++)
+        r->map[code] = (remap_entry_t){ .type = EV_KEY, .code = code };
+    for (int code = 0; code < ABS_CNT; code++)
+        r->map[KEY_CNT + code] = (remap_entry_t){ .type = EV_ABS, .code = code };
+}
+
+// 返回 false 表示事件被丢弃
+static inline bool remap_apply(const remap_t *r, struct input_event *ev) {
+    int idx = remap_index(ev->type, ev->code);
+    if (idx < 0) return true;
+    const remap_entry_t *e = &r->map[idx];
+    if (!e->type) return false;
+    if (e->flags & REMAP_INVERT) ev->value = e->param - ev->value;
+    if (e->flags & REMAP_TO_KEY) ev->value = ev->value >= e->param;
+    ev->type = e->type;
+    ev->code = e->code;
+    return true;
+}
+
+static void remap_set(remap_t *r, int type, int code, remap_entry_t e) {
+    r->map[remap_index(type, code)] = e;
+    r->active = true;
+}
+
+// 内置布局
+static const char *const g_remap_builtins[] = { "nintendo" };
+
+static int remap_builtin(remap_t *r, const char *name) {
+    if (strcmp(name, "nintendo") == 0) {
+        // A/B 与 X/Y 对调
+        remap_set(r, EV_KEY, BTN_SOUTH, (remap_entry_t){ .type = EV_KEY, .code = BTN_EAST });
+        remap_set(r, EV_KEY, BTN_EAST,  (remap_entry_t){ .type = EV_KEY, .code = BTN_SOUTH });
+        remap_set(r, EV_KEY, BTN_NORTH, (remap_entry_t){ .type = EV_KEY, .code = BTN_WEST });
+        remap_set(r, EV_KEY, BTN_WEST,  (remap_entry_t){ .type = EV_KEY, .code = BTN_NORTH });
+        return 0;
+    }
+    return -1;
+}
+
+static int remap_parse_code(const char *tok, int type) {
+    if (type == EV_ABS) return abs_code_from_name(tok, strlen(tok));
+    char *end;
+    long code = strtol(tok, &end, 0);
+    return (*tok && !*end && code >= 0 && code < KEY_CNT) ? (int)code : -1;
+}
+
+// 每行一条规则, # 之后为注释:
+//   key 304 305        按键 304 输出为 305
+//   key 316 none       屏蔽按键
+//   abs y invert       轴反向
+//   abs rx ry          轴换成另一轴
+//   abs z key 312 128  轴值 >= 128 时输出按键 312
+static int remap_parse_line(remap_t *r, char *line) {
+    char *hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+
+    char *tok[5];
+    int n = 0;
+    for (char *save, *t = strtok_r(line, " \t\r\n", &save); t && n < 5; t = strtok_r(NULL, " \t\r\n", &save))
+        tok[n++] = t;
+    if (n == 0) return 0;
+    if (n < 3) return -1;
+
+    int type = strcmp(tok[0], "key") == 0 ? EV_KEY : strcmp(tok[0], "abs") == 0 ? EV_ABS : -1;
+    if (type < 0) return -1;
+    int code = remap_parse_code(tok[1], type);
+    if (code < 0) return -1;
+
+    remap_entry_t e = { .type = type, .code = code };
+    if (strcmp(tok[2], "none") == 0) {
+        e.type = 0;
+    } else if (type == EV_ABS && strcmp(tok[2], "invert") == 0) {
+        e.flags = REMAP_INVERT;
+    } else if (type == EV_ABS && strcmp(tok[2], "key") == 0) {
+        if (n < 5) return -1;
+        int key = remap_parse_code(tok[3], EV_KEY);
+        if (key < 0) return -1;
+        e = (remap_entry_t){ .type = EV_KEY, .code = key, .flags = REMAP_TO_KEY, .param = atoi(tok[4]) };
+    } else {
+        int out = remap_parse_code(tok[2], type);
+        if (out < 0) return -1;
+        e.code = out;
+    }
+    remap_set(r, type, code, e);
+    return 0;
+}
+
+// 反向需要轴量程, 在真实设备打开后补齐; 重映射看到的轴值已换算到虚拟手柄的量程
+static void remap_finalize(remap_t *r, int src_fd, const struct input_absinfo *pad_abs) {
+    for (int code = 0; code < ABS_CNT; code++) {
+        remap_entry_t *e = &r->map[KEY_CNT + code];
+        struct input_absinfo ai;
+        if (!(e->flags & REMAP_INVERT) || ioctl(src_fd, EVIOCGABS(code), &ai) < 0) continue;
+        ai = abs_out_range(pad_abs, code, &ai);
+        e->param = ai.minimum + ai.maximum;
+    }
+}
+
+/* ============================================================
+ * 连发与宏: 定义随方案预编译; 运行时和震动共用同一个 timerfd,
+ * 生成的按键与转发的事件走同一个输出批
+ * ============================================================ */
+#define TURBO_MAX   16
+#define MACRO_MAX   8
+#define MACRO_STEPS 32
+
+typedef struct {
+    uint16_t code;         // 0 表示只等待
+    uint8_t  value;        // 1 按下, 0 松开
+    uint16_t wait_ms;      // 本步之后等待的时间
+} macro_step_t;
+
+typedef struct {
+    uint16_t trigger;
+    uint8_t  n_steps;
+    macro_step_t step[MACRO_STEPS];
+} macro_t;
+
+typedef struct {
+    unsigned long turbo_keys[NLONGS(KEY_CNT)];
+    unsigned long triggers[NLONGS(KEY_CNT)];
+    uint8_t n_turbo, n_macros;
+    struct { uint16_t code, half_ms; } turbo[TURBO_MAX];
+    macro_t macro[MACRO_MAX];
+} macro_set_t;
+
+// "305+" 按下, "305-" 松开, "30ms" 等待
+static int macro_parse_step(macro_t *m, const char *tok) {
+    size_t len = strlen(tok);
+    char *end;
+    long v = strtol(tok, &end, 10);
+    if (len > 2 && strcmp(end, "ms") == 0 && v >= 0 && v <= 60000) {
+        if (m->n_steps == 0) m->step[m->n_steps++] = (macro_step_t){ 0 };
+        uint32_t wait = m->step[m->n_steps - 1].wait_ms + (uint32_t)v;
+        m->step[m->n_steps - 1].wait_ms = wait > 60000 ? 60000 : (uint16_t)wait;
+        return 0;
+    }
+    if (len < 2 || (tok[len - 1] != '+' && tok[len - 1] != '-') || m->n_steps == MACRO_STEPS) return -1;
+    char code[16];
+    if (len - 1 >= sizeof(code)) return -1;
+    memcpy(code, tok, len - 1);
+    code[len - 1] = '\0';
+    int key = remap_parse_code(code, EV_KEY);
+    if (key <= 0) return -1;
+    m->step[m->n_steps++] = (macro_step_t){ .code = key, .value = tok[len - 1] == '+' };
+    return 0;
+}
+
+// 键码均为重映射之后的输出键码:
+//   turbo KEY HZ       按住 KEY 时以 HZ 次/秒连发
+//   macro KEY STEP...  按下 KEY 播放一遍宏, KEY 本身不输出; 结束时松开宏按住的键
+static int macro_parse_line(macro_set_t *ms, char *line) {
+    char *hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+
+    char *save, *word = strtok_r(line, " \t\r\n", &save);
+    char *key_tok = word ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+    int key = key_tok ? remap_parse_code(key_tok, EV_KEY) : -1;
+    if (key <= 0) return -1;
+
+    if (strcmp(word, "turbo") == 0) {
+        char *hz_tok = strtok_r(NULL, " \t\r\n", &save);
+        int hz = hz_tok ? atoi(hz_tok) : 0;
+        if (hz <= 0 || hz > 50 || ms->n_turbo == TURBO_MAX || bit_test(ms->turbo_keys, key)) return -1;
+        ms->turbo[ms->n_turbo].code = key;
+        ms->turbo[ms->n_turbo].half_ms = 500 / hz;
+        ms->n_turbo++;
+        bit_assign(ms->turbo_keys, key, true);
+        return 0;
+    }
+
+    if (ms->n_macros == MACRO_MAX || bit_test(ms->triggers, key)) return -1;
+    macro_t *m = &ms->macro[ms->n_macros];
+    memset(m, 0, sizeof(*m));
+    m->trigger = key;
+    for (char *t; (t = strtok_r(NULL, " \t\r\n", &save)) != NULL; )
+        if (macro_parse_step(m, t) < 0) return -1;
+    if (m->n_steps == 0) return -1;
+    ms->n_macros++;
+    bit_assign(ms->triggers, key, true);
+    return 0;
+}
+
+static inline bool macro_is_trigger(const macro_set_t *ms, int code) {
+    return ms->n_macros && bit_test(ms->triggers, code);
+}
+
+/* ============================================================
+ * 组合键 (--hotkey): 在转发路径上识别, 取代独立轮询 evdev 的 keymon.
+ * 组合里出现的键各分配一个序号, 按住状态是一个 64 位掩码, 按下时与各组合直接比较
+ * ============================================================ */
+#define HOTKEY_MAX  16
+#define HOTKEY_KEYS 64
+
+enum { HOTKEY_EXEC, HOTKEY_SEND };
+
+typedef struct {
+    uint64_t mask;         // 组合中的键 (序号)
+    bool pass;             // 组合照常输出到虚拟手柄, 默认屏蔽
+    int action;
+    const char *path;      // 脚本 / 目标 socket
+    const char *msg;       // HOTKEY_SEND 发送的内容
+} hotkey_t;
+
+static hotkey_t g_hotkeys[HOTKEY_MAX];
+static int g_n_hotkeys;
+static uint8_t g_hk_index[KEY_CNT];        // 键码 -> 序号 + 1, 0 表示不属于任何组合
+static uint16_t g_hk_codes[HOTKEY_KEYS];   // 序号 -> 键码
+static int g_n_hk_keys;
+
+static int hotkey_key_index(int code) {
+    if (!g_hk_index[code]) {
+        if (g_n_hk_keys == HOTKEY_KEYS) return -1;
+        g_hk_codes[g_n_hk_keys] = code;
+        g_hk_index[code] = ++g_n_hk_keys;
+    }
+    return g_hk_index[code] - 1;
+}
+
+// "KEY+KEY[+...]=exec:SCRIPT[,pass]" 或 "KEY+KEY=send:SOCKET:MSG[,pass]", 键码为原始键码.
+// 就地切分 spec, 调用方需保证其在运行期间有效
+static int hotkey_parse(char *spec) {
+    if (g_n_hotkeys == HOTKEY_MAX) return -1;
+    hotkey_t h = {0};
+    char *eq = strchr(spec, '=');
+    if (!eq) return -1;
+    *eq = '\0';
+    char *act = eq + 1;
+
+    int n_keys = 0;
+    for (char *save, *t = strtok_r(spec, "+", &save); t; t = strtok_r(NULL, "+", &save)) {
+        int code = remap_parse_code(t, EV_KEY), idx;
+        if (code <= 0 || (idx = hotkey_key_index(code)) < 0) return -1;
+        h.mask |= 1ULL << idx;
+        n_keys++;
+    }
+    if (n_keys < 2) return -1;
+
+    size_t len = strlen(act);
+    if (len > 5 && strcmp(act + len - 5, ",pass") == 0) {
+        h.pass = true;
+        act[len - 5] = '\0';
+    }
+    if (strncmp(act, "exec:", 5) == 0 && act[5]) {
+        h.action = HOTKEY_EXEC;
+        h.path = act + 5;
+    } else if (strncmp(act, "send:", 5) == 0) {
+        char *colon = strchr(act + 5, ':');
+        if (!colon || colon == act + 5) return -1;
+        *colon = '\0';
+        h.action = HOTKEY_SEND;
+        h.path = act + 5;
+        h.msg = colon + 1;
+    } else {
+        return -1;
+    }
+    g_hotkeys[g_n_hotkeys++] = h;
+    return 0;
+}
+
+/* ============================================================
+ * 派生控制: 扳机轴转数字 L2/R2、摇杆转十字键 (HAT), 模拟值照常输出.
+ * 阈值在 profile_bind 时按虚拟手柄量程换算成整数, 转发时只做比较
+ * ============================================================ */
+#define DERIVE_MAX        8
+#define DERIVE_PRESS_PCT  50     // 默认按下阈值, 行程百分比 (HAT 为半量程)
+#define DERIVE_HYST_PCT   10     // 未给松开阈值时, 比按下阈值低这么多才松开
+#define DERIVE_HATS       (ABS_HAT3Y - ABS_HAT0X + 1)
+
+enum { DERIVE_KEY, DERIVE_HAT };
+
+typedef struct {
+    uint8_t  kind;
+    uint8_t  axis;         // 输出侧 (重映射之后) 的轴
+    uint16_t code;         // DERIVE_KEY: 键码; DERIVE_HAT: HAT 轴
+    uint8_t  press_pct, release_pct;
+    // profile_bind 换算, 虚拟手柄量程上相对 center 的偏移; 按键的 center 为最小值
+    int32_t  center, press, release;
+} derive_t;
+
+typedef struct {
+    uint64_t mask;         // 阈值已换算好的轴
+    int n;
+    derive_t d[DERIVE_MAX];
+} derive_set_t;
+
+// "PRESS[,RELEASE]", 行程百分比, 松开阈值必须低于按下阈值
+static int derive_pct_parse(const char *spec, int *press, int *release) {
+    int p, r;
+    int n = sscanf(spec, "%d,%d", &p, &r);
+    if (n < 1 || p <= 0 || p > 100 || (n == 2 && (r < 0 || r >= p))) return -1;
+    *press = p;
+    *release = n == 2 ? r : p > DERIVE_HYST_PCT ? p - DERIVE_HYST_PCT : 0;
+    return 0;
+}
+
+// 同一个输出只由一根轴驱动, 后加的规则 (方案文件) 覆盖先加的 (--map/命令行)
+static int derive_add(derive_set_t *ds, int kind, int axis, int code, int press, int release) {
+    derive_t d = { .kind = kind, .axis = axis, .code = code, .press_pct = press, .release_pct = release };
+    for (int i = 0; i < ds->n; i++) {
+        if (ds->d[i].kind != kind || ds->d[i].code != code) continue;
+        ds->d[i] = d;
+        return 0;
+    }
+    if (ds->n == DERIVE_MAX) return -1;
+    ds->d[ds->n++] = d;
+    return 0;
+}
+
+//   trigger AXIS KEY [PRESS[,RELEASE]]   轴超过阈值时按下 KEY
+//   dpad AXIS HAT [PRESS[,RELEASE]]      轴偏离中心超过阈值时 HAT 输出 -1/1
+static int derive_parse_line(derive_set_t *ds, char *line) {
+    char *hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+    char word[16], axis[16], out[16], pct[32];
+    int n = sscanf(line, "%15s %15s %15s %31s", word, axis, out, pct);
+    int press = DERIVE_PRESS_PCT, release = DERIVE_PRESS_PCT - DERIVE_HYST_PCT;
+    if (n < 3 || (n == 4 && derive_pct_parse(pct, &press, &release) < 0)) return -1;
+    bool hat = strcmp(word, "dpad") == 0;
+    int a = abs_code_from_name(axis, strlen(axis));
+    int code = remap_parse_code(out, hat ? EV_ABS : EV_KEY);
+    if (a < 0 || (hat ? code < ABS_HAT0X || code > ABS_HAT3Y : code <= 0)) return -1;
+    return derive_add(ds, hat ? DERIVE_HAT : DERIVE_KEY, a, code, press, release);
+}
+
+static void derive_compile(derive_set_t *ds, int src_fd, const struct input_absinfo *pad_abs) {
+    ds->mask = 0;
+    for (int i = 0; i < ds->n; i++) {
+        derive_t *d = &ds->d[i];
+        struct input_absinfo ai = {0};
+        if (ioctl(src_fd, EVIOCGABS(d->axis), &ai) < 0) memset(&ai, 0, sizeof(ai));
+        struct input_absinfo out = abs_out_range(pad_abs, d->axis, &ai);
+        int64_t span = (int64_t)out.maximum - out.minimum;
+        if (span <= 0) continue;
+        if (d->kind == DERIVE_HAT) span /= 2;
+        d->center = out.minimum + (d->kind == DERIVE_HAT ? (int32_t)span : 0);
+        d->press = (int32_t)(span * d->press_pct / 100);
+        d->release = (int32_t)(span * d->release_pct / 100);
+        if (d->press <= 0) continue;
+        if (d->release >= d->press) d->release = d->press - 1;
+        ds->mask |= 1ULL << d->axis;
+    }
+}
+
+static inline bool derive_key_on(const derive_t *d, int32_t v, bool was) {
+    int32_t off = v - d->center;
+    return was ? off > d->release : off >= d->press;
+}
+
+static inline int8_t derive_hat_eval(const derive_t *d, int32_t v, int8_t cur) {
+    int32_t off = v - d->center;
+    if (off >= d->press || (cur > 0 && off > d->release)) return 1;
+    if (off <= -d->press || (cur < 0 && off < -d->release)) return -1;
+    return 0;
+}
+
+/* ============================================================
+ * 方案 (profile): 重映射 + 滤波 + 派生控制 + 震动强度 + 连发/宏, 启动时全部预编译,
+ * 运行中由控制 socket 整体切换, 虚拟手柄保持不变
+ * ============================================================ */
+#define PROFILE_MAX 16
+#define PROFILE_NAME_MAX 32
+
+typedef struct {
+    char name[PROFILE_NAME_MAX];
+    remap_t remap;
+    filter_t filter;
+    derive_set_t derive;
+    uint32_t rumble_scale;   // 震动强度 (Q8, 256 为原样)
+    macro_set_t macros;
+    axis_param_t axis[ABS_CNT]; // 滤波参数, 真实设备打开后才能编译成 filter
+} profile_t;
+
+static profile_t *g_profiles[PROFILE_MAX];
+static int g_n_profiles;
+
+// 方案文件在重映射规则之外还支持:
+//   filter DZ[,HYST]                      两个摇杆的死区/迟滞
+//   axis NAME=DZ[,HYST[,MIN:CENTER:MAX]]  单轴滤波/校准
+//   rumble PCT                            震动强度百分比 (0..400)
+//   turbo KEY HZ / macro KEY STEP...      连发/宏, 见 macro_parse_line
+//   trigger AXIS KEY / dpad AXIS HAT      派生按键/十字键, 见 derive_parse_line
+static int profile_parse_line(profile_t *p, axis_param_t *axis, char *line) {
+    char word[16], arg[128];
+    if (sscanf(line, "%15s %127s", word, arg) == 2) {
+        if (strcmp(word, "turbo") == 0 || strcmp(word, "macro") == 0)
+            return macro_parse_line(&p->macros, line);
+        if (strcmp(word, "trigger") == 0 || strcmp(word, "dpad") == 0)
+            return derive_parse_line(&p->derive, line);
+        if (strcmp(word, "filter") == 0) return stick_filter_parse(arg, axis);
+        if (strcmp(word, "axis") == 0) return axis_option_parse(arg, axis);
+        if (strcmp(word, "rumble") == 0) {
+            int pct = atoi(arg);
+            if (pct < 0 || pct > 400) return -1;
+            p->rumble_scale = pct * 256 / 100;
+            return 0;
+        }
+    }
+    return remap_parse_line(&p->remap, line);
+}
+
+static int profile_load_file(profile_t *p, axis_param_t *axis, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    int lineno = 0, ret = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (profile_parse_line(p, axis, line) < 0) {
+            fprintf(stderr, "%s:%d: bad profile rule\n", path, lineno);
+            ret = -1;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+// 每个方案都以命令行参数 (--filter/--axis/--map) 为底, 再叠加内置布局或方案文件.
+// 这里只解析规则, 不需要真实设备; 依赖设备量程的部分由 profile_bind 补齐
+static profile_t *profile_compile(const char *name, const char *builtin, const char *file) {
+    profile_t *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    memcpy(p->axis, g_cfg.axis, sizeof(p->axis));
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    p->rumble_scale = 256;
+    remap_reset(&p->remap);
+    if (g_cfg.trigger_keys[0]) {
+        derive_add(&p->derive, DERIVE_KEY, ABS_Z, BTN_TL2, g_cfg.trigger_keys[0], g_cfg.trigger_keys[1]);
+        derive_add(&p->derive, DERIVE_KEY, ABS_RZ, BTN_TR2, g_cfg.trigger_keys[0], g_cfg.trigger_keys[1]);
+    }
+    if (g_cfg.stick_dpad[0]) {
+        derive_add(&p->derive, DERIVE_HAT, ABS_X, ABS_HAT0X, g_cfg.stick_dpad[0], g_cfg.stick_dpad[1]);
+        derive_add(&p->derive, DERIVE_HAT, ABS_Y, ABS_HAT0Y, g_cfg.stick_dpad[0], g_cfg.stick_dpad[1]);
+    }
+
+    if ((builtin && remap_builtin(&p->remap, builtin) < 0) ||
+        (g_cfg.remap_file && profile_load_file(p, p->axis, g_cfg.remap_file) < 0) ||
+        (file && profile_load_file(p, p->axis, file) < 0)) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+// pad_abs: 虚拟手柄各轴的量程, 为 NULL 时与真实设备相同
+static void profile_bind(profile_t *p, int src_fd, const struct input_absinfo *pad_abs) {
+    remap_finalize(&p->remap, src_fd, pad_abs);
+    filter_compile(&p->filter, p->axis, src_fd, pad_abs);
+    derive_compile(&p->derive, src_fd, pad_abs);
+}
+
+static void profile_add(profile_t *p) {
+    if (g_n_profiles < PROFILE_MAX) g_profiles[g_n_profiles++] = p;
+    else free(p);
+}
+
+static const profile_t *profile_find(const char *name) {
+    for (int i = 0; i < g_n_profiles; i++)
+        if (strcmp(g_profiles[i]->name, name) == 0) return g_profiles[i];
+    return NULL;
+}
+
+static void profile_load_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "WARN: Cannot open profile dir %s\n", dir);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len <= 5 || len - 5 >= PROFILE_NAME_MAX || strcmp(de->d_name + len - 5, ".conf") != 0)
+            continue;
+        char name[PROFILE_NAME_MAX], path[512];
+        snprintf(name, sizeof(name), "%.*s", (int)(len - 5), de->d_name);
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (profile_find(name)) continue;
+        profile_t *p = profile_compile(name, NULL, path);
+        if (p) profile_add(p);
+        else fprintf(stderr, "WARN: Skipping profile %s\n", path);
+    }
+    closedir(d);
+}
+
+// 解析全部方案, 返回启动时使用的那个
+static const profile_t *profile_init(void) {
+    profile_t *p = profile_compile("default", NULL, NULL);
+    if (!p) {
+        fprintf(stderr, "FATAL: Cannot load remap file %s\n", g_cfg.remap_file);
+        return NULL;
+    }
+    profile_add(p);
+    for (size_t i = 0; i < sizeof(g_remap_builtins) / sizeof(g_remap_builtins[0]); i++)
+        if ((p = profile_compile(g_remap_builtins[i], g_remap_builtins[i], NULL)) != NULL)
+            profile_add(p);
+    if (g_cfg.profile_dir) profile_load_dir(g_cfg.profile_dir);
+
+    const char *name = g_cfg.profile ? g_cfg.profile : "default";
+    const profile_t *cur = profile_find(name);
+    if (!cur) fprintf(stderr, "FATAL: Unknown profile %s\n", name);
+    return cur;
+}
+
+static void profile_bind_all(int src_fd, const struct input_absinfo *pad_abs) {
+    for (int i = 0; i < g_n_profiles; i++) profile_bind(g_profiles[i], src_fd, pad_abs);
+}
+
+static void profile_free_all(void) {
+    for (int i = 0; i < g_n_profiles; i++) free(g_profiles[i]);
+    g_n_profiles = 0;
+}
+
+/* ============================================================
+ * uinput 虚拟设备
+ * ============================================================ */
+// 虚拟手柄的完整描述: 先在内存里拼好, 创建时一次性下发, 不再边查边设
+typedef struct {
+    char name[UINPUT_MAX_NAME_SIZE];
+    struct input_id id;
+    unsigned long keybit[NLONGS(KEY_CNT)];
+    unsigned long absbit[NLONGS(ABS_CNT)];
+    struct input_absinfo abs[ABS_CNT];
+    unsigned long ffbit[NLONGS(FF_CNT)];
+    unsigned long swbit[NLONGS(SW_CNT)];
+    char phys[64];         // 为空时不设置
+} pad_desc_t;
+
+// 实际创建的虚拟手柄; 各来源的轴值都换算到这里的量程
+static pad_desc_t g_pad;
+
+// 真实设备不在时的后备描述 (匹配原厂)
+static const unsigned short g_stock_keys[] = {304,305,307,308, 310,311, 314,315, 316, 317,318};
+
+static const struct { unsigned short code; int min, max; } g_stock_axes[] = {
+    { ABS_X,    -32767, 32767 }, { ABS_Y,    -32767, 32767 },
+    { ABS_RX,   -32767, 32767 }, { ABS_RY,   -32767, 32767 },
+    { ABS_Z,         0,   255 }, { ABS_RZ,        0,   255 },
+    { ABS_HAT0X,    -1,     1 }, { ABS_HAT0Y,    -1,     1 },
+};
+
+// 震动效果: RUMBLE 之外的常量/周期效果也折算到单马达上
+static const unsigned short g_stock_ff[] = {FF_RUMBLE, FF_CONSTANT, FF_PERIODIC, FF_GAIN,
+                                            FF_SQUARE, FF_TRIANGLE, FF_SINE, FF_SAW_UP, FF_SAW_DOWN};
+
+static void pad_desc_stock(pad_desc_t *d) {
+    memset(d, 0, sizeof(*d));
+    snprintf(d->name, sizeof(d->name), "%s", g_cfg.pad_name ? g_cfg.pad_name : DEVICE_NAME);
+    d->id.bustype = BUS_USB;
+    d->id.vendor  = DEVICE_VENDOR;
+    d->id.product = DEVICE_PRODUCT;
+    d->id.version = DEVICE_VERSION;
+    if (g_cfg.pad_id_set) d->id = g_cfg.pad_id;
+    for (size_t i = 0; i < sizeof(g_stock_keys) / sizeof(g_stock_keys[0]); i++)
+        bit_assign(d->keybit, g_stock_keys[i], true);
+    for (size_t i = 0; i < sizeof(g_stock_axes) / sizeof(g_stock_axes[0]); i++) {
+        bit_assign(d->absbit, g_stock_axes[i].code, true);
+        d->abs[g_stock_axes[i].code].minimum = g_stock_axes[i].min;
+        d->abs[g_stock_axes[i].code].maximum = g_stock_axes[i].max;
+    }
+    for (size_t i = 0; i < sizeof(g_stock_ff) / sizeof(g_stock_ff[0]); i++)
+        bit_assign(d->ffbit, g_stock_ff[i], true);
+    bit_assign(d->swbit, SW_TABLET_MODE, true); // 加上 SW
+}
+
+// 照抄真实设备的名字、ID、按键/轴/开关位图和轴参数, 不同固件的额外按键与量程都原样保留.
+// 马达由本程序驱动, 震动能力仍用固定表; 查询失败的部分退回原厂值
+static void pad_desc_clone(pad_desc_t *d, int src_fd) {
+    pad_desc_stock(d);
+    char name[UINPUT_MAX_NAME_SIZE] = {0};
+    if (!g_cfg.pad_name && ioctl(src_fd, EVIOCGNAME(sizeof(name) - 1), name) > 0 && name[0])
+        memcpy(d->name, name, sizeof(name));
+    struct input_id id;
+    if (!g_cfg.pad_id_set && ioctl(src_fd, EVIOCGID, &id) == 0) d->id = id;
+
+    unsigned long keybit[NLONGS(KEY_CNT)] = {0}, absbit[NLONGS(ABS_CNT)] = {0};
+    if (ioctl(src_fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit) >= 0)
+        memcpy(d->keybit, keybit, sizeof(keybit));
+    if (ioctl(src_fd, EVIOCGBIT(EV_ABS, sizeof(absbit)), absbit) >= 0) {
+        memset(d->abs, 0, sizeof(d->abs));
+        memset(d->absbit, 0, sizeof(d->absbit));
+        for (unsigned int code = 0; code < ABS_CNT; code++) {
+            if (!bit_test(absbit, code) || ioctl(src_fd, EVIOCGABS(code), &d->abs[code]) < 0) continue;
+            d->abs[code].value = 0;
+            bit_assign(d->absbit, code, true);
+        }
+    }
+    ioctl(src_fd, EVIOCGBIT(EV_SW, sizeof(d->swbit)), d->swbit);
+    bit_assign(d->swbit, SW_TABLET_MODE, true);
+}
+
+// 任一方案重映射、宏或派生控制产生的按键 (如扳机转 L2/R2) 和 HAT 都提前声明, 切换方案时不用重建设备
+static void profile_pad_targets(pad_desc_t *d) {
+    for (int p = 0; p < g_n_profiles; p++) {
+        const remap_t *r = &g_profiles[p]->remap;
+        const macro_set_t *ms = &g_profiles[p]->macros;
+        const derive_set_t *ds = &g_profiles[p]->derive;
+        // remap_reset 给每个槽填了恒等映射, 只声明真正改过的目标
+        for (int i = 0; r->active && i < REMAP_SLOTS; i++)
+            if (r->map[i].type == EV_KEY && (i >= KEY_CNT || r->map[i].code != i))
+                bit_assign(d->keybit, r->map[i].code, true);
+        for (int i = 0; i < ms->n_macros; i++)
+            for (int j = 0; j < ms->macro[i].n_steps; j++)
+                if (ms->macro[i].step[j].code) bit_assign(d->keybit, ms->macro[i].step[j].code, true);
+        for (int i = 0; i < ds->n; i++) {
+            int code = ds->d[i].code;
+            if (ds->d[i].kind == DERIVE_KEY) {
+                bit_assign(d->keybit, code, true);
+            } else if (!bit_test(d->absbit, code)) {
+                bit_assign(d->absbit, code, true);
+                d->abs[code] = (struct input_absinfo){ .minimum = -1, .maximum = 1 };
+            }
+        }
+    }
+}
+
+// 虚拟手柄比来源 (真实设备或原厂描述) 多声明的按键, 应当只有方案里真正用到的目标
+static int pad_desc_extra_keys(const pad_desc_t *d, const unsigned long *base, bool report) {
+    char list[128] = "";
+    size_t len = 0;
+    int n = 0;
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (!bit_test(d->keybit, code) || bit_test(base, code)) continue;
+        if (n++ < 16) len += snprintf(list + len, sizeof(list) - len, " %d", code);
+    }
+    if (report && n)
+        printf("Virtual pad: %d key(s) beyond the source for profile targets:%s%s\n", n, list, n > 16 ? " ..." : "");
+    return n;
+}
+
+// Player2 照抄 Player1 的描述 (ID 相同, 前端的按键映射照样适用), 名字里的 Player1 换成 Player2,
+// 用 phys 区分两个手柄
+static void pad_desc_player2(pad_desc_t *d, const pad_desc_t *p1) {
+    *d = *p1;
+    char *n = strstr(d->name, "Player1");
+    size_t len = strnlen(d->name, sizeof(d->name) - 1);
+    if (n) n[6] = '2';
+    else if (len + 3 < sizeof(d->name)) memcpy(d->name + len, " P2", 4);
+    snprintf(d->phys, sizeof(d->phys), "%s", PAD_PHYS_PLAYER2);
+}
+
+static void pad_set_bits(int fd, unsigned long req, const unsigned long *map, unsigned int cnt) {
+    for (unsigned int w = 0; w < NLONGS(cnt); w++)
+        for (unsigned long m = map[w]; m; m &= m - 1)
+            ioctl(fd, req, w * BITS_PER_LONG + __builtin_ctzl(m));
+}
+
+// uinput 没有批量接口, 每个能力位仍是一次 ioctl; 这里只保证它们之间没有别的等待
+static int pad_create(const pad_desc_t *d) {
+    int fd = open("/dev/uinput", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_EVBIT, EV_ABS);
+    ioctl(fd, UI_SET_EVBIT, EV_FF);
+    ioctl(fd, UI_SET_EVBIT, EV_SW);
+    pad_set_bits(fd, UI_SET_KEYBIT, d->keybit, KEY_CNT);
+    pad_set_bits(fd, UI_SET_ABSBIT, d->absbit, ABS_CNT);
+    pad_set_bits(fd, UI_SET_FFBIT, d->ffbit, FF_CNT);
+    pad_set_bits(fd, UI_SET_SWBIT, d->swbit, SW_CNT);
+    if (d->phys[0]) ioctl(fd, UI_SET_PHYS, d->phys);
+
+    struct uinput_setup setup = {0};
+    memcpy(setup.name, d->name, sizeof(setup.name));
+    setup.id = d->id;
+    setup.ff_effects_max = RUMBLE_MAX_EFFECTS;
+    ioctl(fd, UI_DEV_SETUP, &setup);
+
+    for (unsigned int code = 0; code < ABS_CNT; code++) {
+        if (!bit_test(d->absbit, code)) continue;
+        struct uinput_abs_setup abs = { .code = code, .absinfo = d->abs[code] };
+        ioctl(fd, UI_ABS_SETUP, &abs);
+    }
+
+    if (ioctl(fd, UI_DEV_CREATE) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* ============================================================
+ * 延迟统计 (--latency, SIGUSR1 输出 p50/p99/max)
+ * ============================================================ */
+// 对数分桶: 每个 2 的幂区间再分 4 档, 128 档覆盖到远超 1 秒
+#define LAT_BUCKETS 128
+
+typedef struct {
+    const char *name;
+    _Atomic uint64_t bucket[LAT_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t max_us;
+} lat_hist_t;
+
+static lat_hist_t g_lat_read  = { .name = "kernel->read" };   // 内核打时间戳到被我们读到
+static lat_hist_t g_lat_total = { .name = "kernel->uinput" }; // 内核打时间戳到写入 uinput 完成
+static volatile sig_atomic_t g_lat_dump_requested = 0;
+
+static unsigned int lat_bucket(uint64_t us) {
+    if (us < 4) return (unsigned int)us;
+    unsigned int msb = 63 - __builtin_clzll(us);
+    unsigned int idx = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+    return idx < LAT_BUCKETS ? idx : LAT_BUCKETS - 1;
+}
+
+static uint64_t lat_bucket_floor(unsigned int idx) {
+    if (idx < 4) return idx;
+    return (uint64_t)(4 + idx % 4) << (idx / 4 - 1);
+}
+
+// 事件时间戳需为 CLOCK_MONOTONIC (EVIOCSCLOCKID); 合成事件时间为 0, 跳过
+static void lat_record(lat_hist_t *h, const struct input_event *evs,
+                       uint32_t start, uint32_t n, uint32_t mask) {
+    struct timespec now;
+    timespec_now(&now);
+    int64_t now_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    for (uint32_t i = 0; i < n; i++) {
+        const struct input_event *ev = &evs[(start + i) & mask];
+        if (ev->input_event_sec == 0 && ev->input_event_usec == 0) continue;
+        int64_t d = now_us - ((int64_t)ev->input_event_sec * 1000000 + ev->input_event_usec);
+        uint64_t us = d > 0 ? (uint64_t)d : 0;
+        atomic_fetch_add_explicit(&h->bucket[lat_bucket(us)], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+        if (us > atomic_load_explicit(&h->max_us, memory_order_relaxed))
+            atomic_store_explicit(&h->max_us, us, memory_order_relaxed);
+    }
+}
+
+static uint64_t lat_percentile(lat_hist_t *h, uint64_t count, unsigned int pct) {
+    uint64_t want = (count * pct + 99) / 100, seen = 0;
+    for (unsigned int i = 0; i < LAT_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+        if (seen >= want) return lat_bucket_floor(i);
+    }
+    return 0;
+}
+
+static void lat_dump(void) {
+    lat_hist_t *hists[] = { &g_lat_read, &g_lat_total };
+    for (size_t i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+        lat_hist_t *h = hists[i];
+        uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+        if (count == 0) {
+            fprintf(stderr, "latency %-14s no samples\n", h->name);
+            continue;
+        }
+        fprintf(stderr, "latency %-14s n=%llu p50=%lluus p99=%lluus max=%lluus\n", h->name,
+                (unsigned long long)count,
+                (unsigned long long)lat_percentile(h, count, 50),
+                (unsigned long long)lat_percentile(h, count, 99),
+                (unsigned long long)atomic_load_explicit(&h->max_us, memory_order_relaxed));
+    }
+}
+
+static void handle_sigusr1(int sig) {
+    (void)sig;
+    g_lat_dump_requested = 1;
+}
+
+/* ============================================================
+ * 输入转发 (按 SYN_REPORT 成帧批量写出)
+ * ============================================================ */
+#define FWD_RING_EVENTS 256   // 原始事件环形缓冲, 必须是 2 的幂
+#define FWD_OUT_EVENTS  320   // 单次唤醒累积的输出事件上限, 需大于环 + 余量
+#define FWD_FRAME_SLACK 24    // 处理后一帧可能比输入多出的事件数 (摇杆对、派生控制等)
+#define SINK_PEND_EVENTS 1024 // 写不进 uinput 时积压的事件上限, 需大于 KEY_CNT + ABS_CNT
+#define SINK_RETRY_MS    4    // 重试没有进展时的退避间隔
+
+typedef struct {
+    uint16_t code, half_ms;
+    struct timespec next;  // 下一次翻转
+} turbo_run_t;
+
+typedef struct {
+    const macro_t *m;      // NULL 表示未在播放
+    uint8_t pc;
+    struct timespec next;  // 下一步的时间
+    unsigned long held[NLONGS(KEY_CNT)]; // 本次播放按住的键, 与真实来源一起参与计数
+} macro_run_t;
+
+// 虚拟手柄一侧: 所有来源共用一个输出批, 每次唤醒只 write 一次
+typedef struct {
+    struct input_event out[FWD_OUT_EVENTS];
+    uint32_t out_len;
+    uint64_t n_writes;
+
+    // 已经发给虚拟手柄的状态
+    unsigned long keys[NLONGS(KEY_CNT)];
+    int32_t abs[ABS_CNT];
+    uint8_t key_refs[KEY_CNT];    // 按住该键的来源数, 0/1 之间变化时才输出
+
+    // 连发/宏: 定义来自当前方案
+    const macro_set_t *macros;
+    turbo_run_t turbo[TURBO_MAX]; // 正在连发的键 (下游按住与否即当前相位)
+    uint8_t n_turbo;
+    macro_run_t run[MACRO_MAX];   // 与 macros->macro 一一对应
+
+    // 组合键: 各来源合并后的按住状态, 以及本轮触发、待主循环执行的组合
+    uint8_t hk_refs[HOTKEY_KEYS];
+    uint64_t hk_held;
+    uint32_t hk_fire;
+
+    // 积压队列: 没写进去的完整帧, 按顺序等 EPOLLOUT 重试; [head, len) 尚未写入.
+    // barrier 之后只有 ABS/SYN; 新来的纯轴帧的每根轴都在队尾帧 (从 frame 开始) 里时整帧并入
+    struct input_event pend[SINK_PEND_EVENTS];
+    uint32_t pend_head, pend_len, pend_barrier, pend_frame;
+    bool stalled;          // 上次重试一个事件也没写进去
+
+    // 摇杆限速: 间隔内到来的轴值只在 abs 里保留最新, 到点或随按键帧一起输出
+    uint64_t abs_held;     // 攒着还没输出的轴
+    uint32_t frame_mark;   // 当前帧在 out 中的起点
+    bool frame_edge;       // 当前帧有按键/开关/方向键, 立即输出
+    bool frame_abs;        // 当前帧有轴值被攒下, 帧尾的 SYN 不能省掉
+    struct timespec abs_next; // 下一次允许单独输出轴帧的时间
+
+    int timer;             // 本输出批那组定时器的起点 (TIMER_PAD + 手柄序号 * TIMER_PAD_SLOTS)
+    int fd;                // 对应的虚拟手柄, 一帧中途装满输出批时直接写出
+} fwd_sink_t;
+
+typedef struct {
+    int32_t in_min, out_min, out_max;
+    int32_t k;             // Q16 斜率
+} abs_scale_t;
+
+// 每个真实设备一份
+typedef struct {
+    struct input_event ring[FWD_RING_EVENTS];
+    uint32_t head;         // 写入位置 (自由递增, 取模访问)
+    uint32_t tail;         // 当前未完成帧的起点
+    uint32_t scan;         // 已检查到的位置, 避免重复扫描
+    bool dropping;         // 收到 SYN_DROPPED, 丢弃到下一个 SYN_REPORT
+
+    fwd_sink_t *sink;
+
+    // 系统调用与帧计数, 用于衡量批量化效果
+    uint64_t n_reads;
+    uint64_t n_frames;
+
+    unsigned long absbit[NLONGS(ABS_CNT)];
+    unsigned long keybit[NLONGS(KEY_CNT)];
+    unsigned long held[NLONGS(KEY_CNT)];  // 本来源在下游按住的键 (映射后), SYN_DROPPED 之后据此补发差异
+    int32_t abs_rest[ABS_CNT];    // 设备断开时各轴回到的静止值 (输入侧)
+
+    const profile_t *profile;     // 当前方案, 只在帧之间切换
+    uint64_t filter_mask;         // 滤波按主设备的量程编译, 附加来源为 0
+
+    // 量程与虚拟手柄不同的轴 (未滤波时) 按线性关系换算, 相同的轴原样通过
+    uint64_t scale_mask;
+    abs_scale_t scale[ABS_CNT];
+
+    uint64_t hk_held;             // 本来源按住的组合键 (序号)
+    uint64_t hk_swallow;          // 已被组合吞掉, 直到松开都不再输出
+
+    // 滤波: 本帧被滤波轴的原始值先暂存, 到 SYN_REPORT 时统一计算输出
+    int32_t raw[ABS_CNT];
+    int32_t filt_last[ABS_CNT];   // 每根输入轴上次的滤波输出, 用于迟滞
+    uint64_t touched;
+
+    // 派生控制的当前状态; 按键单独记录, 不参与映射后按键的补发对比
+    unsigned long derive_held[NLONGS(KEY_CNT)];
+    int8_t derive_hat[DERIVE_HATS];
+} fwd_ctx_t;
+
+// 写一次, 返回写进去的事件数; 统计只在寄存器里按类型计数, 每批各存一次
+static uint32_t sink_write(fwd_sink_t *o, int virt_fd, const struct input_event *evs, uint32_t count) {
+    size_t len = count * sizeof(struct input_event);
+    ssize_t n = write(virt_fd, evs, len);
+    o->n_writes++;
+    STAT_ADD(writes, 1);
+    if (n < 0) {
+        if (errno == EAGAIN) STAT_ADD(write_again, 1);
+        else STAT_ADD(write_errors, 1);
+        return 0;
+    }
+    if ((size_t)n < len) STAT_ADD(write_short, 1);
+
+    uint32_t done = (uint32_t)((size_t)n / sizeof(struct input_event)), n_syn = 0, n_key = 0, n_abs = 0;
+    for (uint32_t i = 0; i < done; i++) {
+        n_syn += evs[i].type == EV_SYN;
+        n_key += evs[i].type == EV_KEY;
+        n_abs += evs[i].type == EV_ABS;
+    }
+    STAT_ADD(ev_syn, n_syn);
+    STAT_ADD(ev_key, n_key);
+    STAT_ADD(ev_abs, n_abs);
+    if (done != n_syn + n_key + n_abs) STAT_ADD(ev_other, done - n_syn - n_key - n_abs);
+    return done;
+}
+
+static inline bool sink_pending(const fwd_sink_t *o) {
+    return o->pend_head != o->pend_len;
+}
+
+static inline void sink_pend_put(fwd_sink_t *o, int type, int code, int value) {
+    struct input_event ev = {0};
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    o->pend[o->pend_len++] = ev;
+}
+
+// 队列满: 丢掉积压的事件, 换成一帧只含其中涉及的键/轴的当前值.
+// 下游对相同值不会重复上报, 按键不会卡住, 也不会凭空多出按下
+static void sink_overflow(fwd_sink_t *o, const struct input_event *rest, uint32_t n) {
+    unsigned long keys[NLONGS(KEY_CNT)] = {0};
+    uint64_t axes = 0;
+    for (uint32_t i = o->pend_head; i < o->pend_len + n; i++) {
+        const struct input_event *ev = i < o->pend_len ? &o->pend[i] : &rest[i - o->pend_len];
+        if (ev->type == EV_KEY && ev->code < KEY_CNT) bit_assign(keys, ev->code, true);
+        else if (ev->type == EV_ABS && ev->code < ABS_CNT) axes |= 1ULL << ev->code;
+    }
+    o->pend_head = o->pend_len = o->pend_frame = 0;
+    for (unsigned int code = 0; code < KEY_CNT; code++)
+        if (bit_test(keys, code)) sink_pend_put(o, EV_KEY, code, bit_test(o->keys, code));
+    o->pend_barrier = o->pend_len;
+    for (uint64_t m = axes; m; m &= m - 1) {
+        int code = __builtin_ctzll(m);
+        sink_pend_put(o, EV_ABS, code, o->abs[code]);
+    }
+    sink_pend_put(o, EV_SYN, SYN_REPORT, 0);
+    STAT_ADD(queue_overflows, 1);
+}
+
+// 队尾帧尚未开始写入、只含轴值, 且新帧的每根轴都在其中时, 用新值整帧覆盖.
+// 部分轴并入前一帧会把一帧拆成两次 SYN (如摇杆 X 先到、Y 晚一帧), 这种帧原样追加
+static bool sink_fold(fwd_sink_t *o, const struct input_event *evs, uint32_t n) {
+    uint32_t start = o->pend_frame;
+    if (o->pend_len == start || start < o->pend_head || start < o->pend_barrier) return false;
+    const struct input_event *last = &o->pend[o->pend_len - 1];
+    if (last->type != EV_SYN || last->code != SYN_REPORT) return false;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < n; i++) {
+            const struct input_event *ev = &evs[i];
+            if (ev->type == EV_SYN && ev->code == SYN_REPORT) continue;
+            if (ev->type != EV_ABS) return false;
+            uint32_t j = start;
+            while (j < o->pend_len && !(o->pend[j].type == EV_ABS && o->pend[j].code == ev->code)) j++;
+            if (j == o->pend_len) return false;
+            if (pass) o->pend[j].value = ev->value;
+        }
+    }
+    return true;
+}
+
+// 按帧 (以 SYN_REPORT 结尾) 追加到积压队列, 能整帧并入队尾帧的省掉
+static void sink_queue(fwd_sink_t *o, const struct input_event *evs, uint32_t n) {
+    if (o->pend_head == o->pend_len) o->pend_head = o->pend_len = o->pend_barrier = o->pend_frame = 0;
+    if (o->pend_len + n > SINK_PEND_EVENTS && o->pend_head > 0) {
+        memmove(o->pend, o->pend + o->pend_head, (o->pend_len - o->pend_head) * sizeof(o->pend[0]));
+        o->pend_len -= o->pend_head;
+        o->pend_barrier = o->pend_barrier > o->pend_head ? o->pend_barrier - o->pend_head : 0;
+        o->pend_frame = o->pend_frame > o->pend_head ? o->pend_frame - o->pend_head : 0;
+        o->pend_head = 0;
+    }
+
+    for (uint32_t i = 0; i < n; ) {
+        uint32_t end = i;
+        while (end < n && !(evs[end].type == EV_SYN && evs[end].code == SYN_REPORT)) end++;
+        if (end < n) end++;
+        if (end - i > 1 && evs[end - 1].type == EV_SYN && sink_fold(o, evs + i, end - i)) {
+            i = end;
+            continue;
+        }
+        o->pend_frame = o->pend_len;
+        for (; i < end; i++) {
+            if (o->pend_len == SINK_PEND_EVENTS) {
+                sink_overflow(o, evs + i, n - i);
+                return;
+            }
+            o->pend[o->pend_len++] = evs[i];
+            if (evs[i].type != EV_ABS && evs[i].type != EV_SYN) o->pend_barrier = o->pend_len;
+        }
+    }
+}
+
+// 按顺序重写积压队列, 部分写入时从断点继续, 帧的剩余部分总是跟着它的 SYN_REPORT
+static void sink_retry(fwd_sink_t *o, int virt_fd) {
+    uint32_t before = o->pend_head;
+    while (sink_pending(o)) {
+        uint32_t done = sink_write(o, virt_fd, o->pend + o->pend_head, o->pend_len - o->pend_head);
+        if (done == 0) break;
+        o->pend_head += done;
+    }
+    o->stalled = sink_pending(o) && o->pend_head == before;
+    if (o->stalled) {
+        struct timespec due;
+        timespec_now(&due);
+        timespec_add_ms(&due, SINK_RETRY_MS);
+        timer_set(o->timer + TIMER_FLUSH, &due);
+    } else if (!sink_pending(o)) {
+        timer_clear(o->timer + TIMER_FLUSH);
+    }
+}
+
+// 输出批都是完整帧. 没有积压时直接写; 否则排到积压之后, 保证顺序
+static void sink_flush(fwd_sink_t *o, int virt_fd) {
+    if (o->out_len == 0 && !sink_pending(o)) return;
+    if (o->out_len) {
+        if (rec_enabled()) rec_events(o->out, o->out_len);
+        uint32_t done = sink_pending(o) ? 0 : sink_write(o, virt_fd, o->out, o->out_len);
+        if (done < o->out_len) {
+            STAT_ADD(write_queued, 1);
+            sink_queue(o, o->out + done, o->out_len - done);
+        }
+        if (g_cfg.latency) lat_record(&g_lat_total, o->out, 0, o->out_len, ~0U);
+        o->out_len = 0;
+        o->frame_mark = 0;
+    }
+    if (sink_pending(o)) sink_retry(o, virt_fd);
+}
+
+static inline void fwd_flush(fwd_ctx_t *fwd, int virt_fd) {
+    sink_flush(fwd->sink, virt_fd);
+}
+
+// 轴帧的最短间隔, 启动时由 --abs-rate 换算 (config_finalize), 0 表示不限速
+static long g_abs_interval_ns;
+
+// 方向键在本机上是 HAT 轴, 和按键一样不限速
+static inline bool sink_abs_throttled(unsigned int code) {
+    return code < ABS_HAT0X || code > ABS_HAT3Y;
+}
+
+// 限速时在 SYN_REPORT 处决定本帧去留: 有按键沿或已到间隔时带上攒下的轴值输出,
+// 否则整帧丢弃 (MSC 之类随帧附带的事件一起丢掉), 到点由 TIMER_ABS 补一帧
+static bool sink_throttle_frame(fwd_sink_t *o) {
+    struct timespec now;
+    timespec_now(&now);
+    bool due = timespec_passed(&o->abs_next, &now);
+    int n_held = __builtin_popcountll(o->abs_held);
+    if (o->abs_held && (o->frame_edge || due) && o->out_len + n_held < FWD_OUT_EVENTS) {
+        for (uint64_t m = o->abs_held; m; m &= m - 1) {
+            struct input_event *ev = &o->out[o->out_len++];
+            memset(ev, 0, sizeof(*ev));
+            ev->type = EV_ABS;
+            ev->code = __builtin_ctzll(m);
+            ev->value = o->abs[ev->code];
+        }
+        o->abs_held = 0;
+        o->abs_next = now;
+        timespec_add_ns(&o->abs_next, g_abs_interval_ns);
+        timer_clear(o->timer + TIMER_ABS);
+        return true;
+    }
+    if (o->abs_held) timer_set(o->timer + TIMER_ABS, &o->abs_next);
+    if (o->frame_edge) return true;
+    o->out_len = o->frame_mark;
+    return false;
+}
+
+// 放入输出批, 同时记录下游看到的状态.
+// 派生控制和无 SYN 的整环强制送出都可能让一帧超过 FWD_FRAME_SLACK 的估计, 装满时先写出已有部分
+static void sink_emit(fwd_sink_t *o, const struct input_event *ev) {
+    if (o->out_len == FWD_OUT_EVENTS) sink_flush(o, o->fd);
+    if (ev->type == EV_KEY && ev->code < KEY_CNT && ev->value != 2)
+        bit_assign(o->keys, ev->code, ev->value != 0);
+    else if (ev->type == EV_ABS && ev->code < ABS_CNT)
+        o->abs[ev->code] = ev->value;
+
+    if (g_abs_interval_ns) {
+        if (ev->type == EV_ABS && ev->code < ABS_CNT && sink_abs_throttled(ev->code)) {
+            o->abs_held |= 1ULL << ev->code;
+            o->frame_abs = true;
+            return;
+        }
+        if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+            bool keep = sink_throttle_frame(o);
+            o->frame_edge = o->frame_abs = false;
+            if (!keep) return;
+            o->out[o->out_len++] = *ev;
+            o->frame_mark = o->out_len;
+            return;
+        }
+        if (ev->type == EV_KEY || ev->type == EV_SW || ev->type == EV_ABS) o->frame_edge = true;
+    }
+    o->out[o->out_len++] = *ev;
+}
+
+static void sink_emit_simple(fwd_sink_t *o, int type, int code, int value) {
+    struct input_event ev = {0};
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    sink_emit(o, &ev);
+}
+
+// 连发/宏共用 TIMER_MACRO, 取所有进行中项目的最早时间
+static void macro_arm(fwd_sink_t *o) {
+    const struct timespec *due = NULL;
+    for (int i = 0; i < o->n_turbo; i++)
+        if (!due || timespec_cmp(&o->turbo[i].next, due) < 0) due = &o->turbo[i].next;
+    for (int i = 0; o->macros && i < o->macros->n_macros; i++)
+        if (o->run[i].m && (!due || timespec_cmp(&o->run[i].next, due) < 0)) due = &o->run[i].next;
+    if (due) timer_set(o->timer + TIMER_MACRO, due);
+    else timer_clear(o->timer + TIMER_MACRO);
+}
+
+static void turbo_start(fwd_sink_t *o, int code) {
+    const macro_set_t *ms = o->macros;
+    for (int i = 0; i < ms->n_turbo; i++) {
+        if (ms->turbo[i].code != code) continue;
+        turbo_run_t *t = &o->turbo[o->n_turbo++];
+        t->code = code;
+        t->half_ms = ms->turbo[i].half_ms;
+        timespec_now(&t->next);
+        timespec_add_ms(&t->next, t->half_ms);
+        macro_arm(o);
+        return;
+    }
+}
+
+static void turbo_stop(fwd_sink_t *o, int code) {
+    for (int i = 0; i < o->n_turbo; i++) {
+        if (o->turbo[i].code != code) continue;
+        o->turbo[i] = o->turbo[--o->n_turbo];
+        macro_arm(o);
+        return;
+    }
+}
+
+// 多个来源 (含宏) 按住同一个键时合并: 第一个按下才输出按下, 最后一个松开才输出松开.
+// 连发键在下游可能处于松开相位, 此时重复和松开事件都不再输出
+static void sink_key(fwd_sink_t *o, unsigned long *held, const struct input_event *ev) {
+    uint8_t *refs = &o->key_refs[ev->code];
+    bool was = bit_test(held, ev->code);
+    if (ev->value == 2) {
+        if (was && bit_test(o->keys, ev->code)) sink_emit(o, ev);
+        return;
+    }
+    if ((ev->value != 0) == was) return;
+    bit_assign(held, ev->code, !was);
+    if (was ? --*refs != 0 : (*refs)++ != 0) return;
+    if (o->macros && bit_test(o->macros->turbo_keys, ev->code)) {
+        if (ev->value) turbo_start(o, ev->code);
+        else turbo_stop(o, ev->code);
+    }
+    if (ev->value || bit_test(o->keys, ev->code)) sink_emit(o, ev);
+}
+
+static void macro_start(fwd_sink_t *o, int trigger) {
+    const macro_set_t *ms = o->macros;
+    for (int i = 0; i < ms->n_macros; i++) {
+        macro_run_t *r = &o->run[i];
+        if (ms->macro[i].trigger != trigger || r->m) continue;
+        r->m = &ms->macro[i];
+        r->pc = 0;
+        // 第一步在本轮事件分发之后由定时器执行, 不插进正在转发的帧
+        timespec_now(&r->next);
+        macro_arm(o);
+        return;
+    }
+}
+
+static void macro_release_run(fwd_sink_t *o, macro_run_t *r) {
+    for (unsigned int w = 0; w < NLONGS(KEY_CNT); w++) {
+        while (r->held[w]) {
+            struct input_event ev = { .type = EV_KEY, .code = w * BITS_PER_LONG + __builtin_ctzl(r->held[w]) };
+            sink_key(o, r->held, &ev);
+        }
+    }
+    r->m = NULL;
+}
+
+// 执行所有到期的连发翻转和宏步骤; 宏的每一步单独成帧
+static void macro_service(fwd_sink_t *o, const struct timespec *now, int virt_fd) {
+    bool toggled = false;
+    for (int i = 0; i < o->n_turbo; i++) {
+        turbo_run_t *t = &o->turbo[i];
+        if (!timespec_passed(&t->next, now)) continue;
+        sink_emit_simple(o, EV_KEY, t->code, !bit_test(o->keys, t->code));
+        toggled = true;
+        timespec_add_ms(&t->next, t->half_ms);
+        if (timespec_passed(&t->next, now)) {
+            t->next = *now;
+            timespec_add_ms(&t->next, t->half_ms);
+        }
+    }
+    if (toggled) sink_emit_simple(o, EV_SYN, SYN_REPORT, 0);
+
+    for (int i = 0; o->macros && i < o->macros->n_macros; i++) {
+        macro_run_t *r = &o->run[i];
+        while (r->m && timespec_passed(&r->next, now)) {
+            if (o->out_len >= FWD_OUT_EVENTS - FWD_FRAME_SLACK) sink_flush(o, virt_fd);
+            uint32_t start = o->out_len;
+            if (r->pc == r->m->n_steps) {
+                // 最后一步的等待也已结束
+                macro_release_run(o, r);
+            } else {
+                const macro_step_t *st = &r->m->step[r->pc++];
+                if (st->code) {
+                    struct input_event ev = { .type = EV_KEY, .code = st->code, .value = st->value };
+                    sink_key(o, r->held, &ev);
+                }
+                timespec_add_ms(&r->next, st->wait_ms);
+            }
+            if (o->out_len != start) sink_emit_simple(o, EV_SYN, SYN_REPORT, 0);
+        }
+    }
+    macro_arm(o);
+}
+
+// 切换方案或挂起: 停掉所有宏并松开它们按住的键, 处于松开相位的连发键恢复为按住
+static void macro_reset(fwd_sink_t *o, int virt_fd) {
+    uint32_t start = o->out_len;
+    if (o->out_len >= FWD_OUT_EVENTS - FWD_FRAME_SLACK - MACRO_MAX) sink_flush(o, virt_fd);
+    for (int i = 0; i < MACRO_MAX; i++)
+        if (o->run[i].m) macro_release_run(o, &o->run[i]);
+    // 停下的连发键仍有来源按住时补回按下; 已经没人按住的 (如被新方案的映射松开) 保持松开
+    for (int i = 0; i < o->n_turbo; i++) {
+        int code = o->turbo[i].code;
+        if (o->key_refs[code] && !bit_test(o->keys, code)) sink_emit_simple(o, EV_KEY, code, 1);
+    }
+    o->n_turbo = 0;
+    if (o->out_len > start) sink_emit_simple(o, EV_SYN, SYN_REPORT, 0);
+    macro_arm(o);
+}
+
+static inline void fwd_emit(fwd_ctx_t *fwd, const struct input_event *ev) {
+    sink_emit(fwd->sink, ev);
+}
+
+static void fwd_emit_simple(fwd_ctx_t *fwd, int type, int code, int value) {
+    sink_emit_simple(fwd->sink, type, code, value);
+}
+
+static inline void fwd_key(fwd_ctx_t *fwd, const struct input_event *ev) {
+    sink_key(fwd->sink, fwd->held, ev);
+}
+
+static void fwd_derive_key(fwd_ctx_t *fwd, int code, bool on) {
+    struct input_event ev = { .type = EV_KEY, .code = code, .value = on };
+    sink_key(fwd->sink, fwd->derive_held, &ev);
+}
+
+// 与十字键共用一个 HAT 时, 后变化的一方为准
+static void fwd_derive_hat(fwd_ctx_t *fwd, int code, int8_t val) {
+    int8_t *cur = &fwd->derive_hat[code - ABS_HAT0X];
+    if (*cur == val) return;
+    *cur = val;
+    if (fwd->sink->abs[code] != val) fwd_emit_simple(fwd, EV_ABS, code, val);
+}
+
+// 输出轴值变化时按阈值更新派生控制, 与模拟值在同一帧输出
+static void fwd_derive(fwd_ctx_t *fwd, int axis, int32_t v) {
+    const derive_set_t *ds = &fwd->profile->derive;
+    for (int i = 0; i < ds->n; i++) {
+        const derive_t *d = &ds->d[i];
+        if (d->axis != axis) continue;
+        if (d->kind == DERIVE_KEY)
+            fwd_derive_key(fwd, d->code, derive_key_on(d, v, bit_test(fwd->derive_held, d->code)));
+        else
+            fwd_derive_hat(fwd, d->code, derive_hat_eval(d, v, fwd->derive_hat[d->code - ABS_HAT0X]));
+    }
+}
+
+// 补发状态时按下游当前的轴值重新判断; 切换方案后旧规则留下的按键/方向也在这里松开
+static void fwd_derive_sync(fwd_ctx_t *fwd) {
+    const derive_set_t *ds = &fwd->profile->derive;
+    unsigned long want[NLONGS(KEY_CNT)] = {0};
+    int8_t hat[DERIVE_HATS] = {0};
+    for (int i = 0; i < ds->n; i++) {
+        const derive_t *d = &ds->d[i];
+        if (!(ds->mask >> d->axis & 1)) continue;
+        int32_t v = fwd->sink->abs[d->axis];
+        if (d->kind == DERIVE_KEY)
+            bit_assign(want, d->code, derive_key_on(d, v, bit_test(fwd->derive_held, d->code)));
+        else
+            hat[d->code - ABS_HAT0X] = derive_hat_eval(d, v, fwd->derive_hat[d->code - ABS_HAT0X]);
+    }
+    for (unsigned int i = 0; i < NLONGS(KEY_CNT); i++) {
+        unsigned long diff = want[i] ^ fwd->derive_held[i];
+        while (diff) {
+            unsigned int code = i * BITS_PER_LONG + __builtin_ctzl(diff);
+            diff &= diff - 1;
+            fwd_derive_key(fwd, code, bit_test(want, code));
+        }
+    }
+    for (int i = 0; i < DERIVE_HATS; i++) fwd_derive_hat(fwd, ABS_HAT0X + i, hat[i]);
+}
+
+// 处理完的事件经重映射后输出; 与下游当前状态相同的值直接丢弃
+static void fwd_output(fwd_ctx_t *fwd, const struct input_event *in) {
+    struct input_event ev = *in;
+    const remap_t *r = &fwd->profile->remap;
+    if (r->active && !remap_apply(r, &ev)) return;
+    if (ev.type == EV_KEY && ev.code < KEY_CNT) {
+        if (macro_is_trigger(&fwd->profile->macros, ev.code)) {
+            if (ev.value == 1) macro_start(fwd->sink, ev.code);
+            return;
+        }
+        fwd_key(fwd, &ev);
+        return;
+    }
+    if (ev.type == EV_ABS && ev.code < ABS_CNT) {
+        if (fwd->sink->abs[ev.code] == ev.value) return;
+        fwd_emit(fwd, &ev);
+        if (fwd->profile->derive.mask >> ev.code & 1) fwd_derive(fwd, ev.code, ev.value);
+        return;
+    }
+    fwd_emit(fwd, &ev);
+}
+
+static void fwd_output_simple(fwd_ctx_t *fwd, int type, int code, int value) {
+    struct input_event ev = {0};
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    fwd_output(fwd, &ev);
+}
+
+static void fwd_filter_out(fwd_ctx_t *fwd, int code, int32_t n) {
+    const axis_filter_t *a = &fwd->profile->filter.axis[code];
+    int32_t v = filter_denorm(a, n), last = fwd->filt_last[code];
+    if (v == last) return;
+    // 迟滞只抑制小抖动, 回到中心总是输出
+    if (v != a->out_base && (v > last ? v - last : last - v) <= a->hyst) return;
+    fwd->filt_last[code] = v;
+    fwd_output_simple(fwd, EV_ABS, code, v);
+}
+
+// 计算本帧所有被触碰的滤波轴; 摇杆对一起算径向死区
+static void fwd_filter_commit(fwd_ctx_t *fwd) {
+    uint64_t t = fwd->touched;
+    fwd->touched = 0;
+    while (t) {
+        int code = __builtin_ctzll(t);
+        t &= t - 1;
+        const axis_filter_t *a = &fwd->profile->filter.axis[code];
+        int32_t n = filter_norm(a, fwd->raw[code]);
+        if (a->pair < 0) {
+            fwd_filter_out(fwd, code, filter_axial(a, n));
+            continue;
+        }
+        int pair = a->pair;
+        int32_t m = filter_norm(&fwd->profile->filter.axis[pair], fwd->raw[pair]);
+        t &= ~(1ULL << pair);
+        filter_radial(a, &n, &m);
+        fwd_filter_out(fwd, code, n);
+        fwd_filter_out(fwd, pair, m);
+    }
+}
+
+static inline bool fwd_filtered(const fwd_ctx_t *fwd, const struct input_event *ev) {
+    return ev->type == EV_ABS && ev->code < ABS_CNT && (fwd->filter_mask >> ev->code & 1);
+}
+
+static inline int32_t fwd_scale(const fwd_ctx_t *fwd, int code, int32_t v) {
+    if (!(fwd->scale_mask >> code & 1)) return v;
+    const abs_scale_t *sc = &fwd->scale[code];
+    int64_t out = sc->out_min + (((int64_t)(v - sc->in_min) * sc->k + 0x8000) >> 16);
+    return out < sc->out_min ? sc->out_min : out > sc->out_max ? sc->out_max : (int32_t)out;
+}
+
+static void hotkey_set(fwd_ctx_t *fwd, int idx, bool down) {
+    uint64_t bit = 1ULL << idx;
+    fwd_sink_t *o = fwd->sink;
+    if (!(fwd->hk_held & bit) == !down) return;
+    fwd->hk_held ^= bit;
+    if (down ? o->hk_refs[idx]++ == 0 : --o->hk_refs[idx] == 0) o->hk_held ^= bit;
+    if (!down) fwd->hk_swallow &= ~bit;
+}
+
+// 原始按键经过组合键识别; 返回 true 表示该事件被吞掉.
+// 按下使某个组合完整时记下待执行, 其余已输出的组合键由主循环补发松开
+static bool hotkey_input(fwd_ctx_t *fwd, const struct input_event *ev) {
+    int idx = g_hk_index[ev->code] - 1;
+    uint64_t bit = 1ULL << idx;
+    bool swallowed = fwd->hk_swallow & bit;
+    if (ev->value == 2) return swallowed;
+    hotkey_set(fwd, idx, ev->value != 0);
+    if (!ev->value) return swallowed;
+
+    fwd_sink_t *o = fwd->sink;
+    for (int i = 0; i < g_n_hotkeys; i++) {
+        const hotkey_t *h = &g_hotkeys[i];
+        if (!(h->mask & bit) || (o->hk_held & h->mask) != h->mask) continue;
+        o->hk_fire |= 1U << i;
+        if (h->pass) return false;
+        fwd->hk_swallow |= bit;
+        return true;
+    }
+    return false;
+}
+
+// 未滤波的原始事件: 先识别组合键, 再换算到虚拟手柄量程后输出
+static void fwd_input(fwd_ctx_t *fwd, const struct input_event *in) {
+    if (in->type == EV_KEY && in->code < KEY_CNT && g_hk_index[in->code] && hotkey_input(fwd, in))
+        return;
+    if (in->type == EV_ABS && in->code < ABS_CNT && (fwd->scale_mask >> in->code & 1)) {
+        struct input_event ev = *in;
+        ev.value = fwd_scale(fwd, ev.code, ev.value);
+        fwd_output(fwd, &ev);
+        return;
+    }
+    fwd_output(fwd, in);
+}
+
+// 把输入侧的完整状态 (按键位图 + have 中各轴的值) 按当前方案映射后, 与下游不一致的部分作为一帧补发.
+// 按键先算出映射后应处于按下的集合再与本来源按住的键求差, 切换方案后旧映射残留的按键也会松开
+static void fwd_sync_state(fwd_ctx_t *fwd, const unsigned long *keys, const int32_t *vals,
+                           uint64_t have, int virt_fd) {
+    unsigned long want[NLONGS(KEY_CNT)] = {0};
+    const remap_t *r = &fwd->profile->remap;
+    // 组合键只跟随状态, 补发时不触发; 被吞掉的键保持不输出
+    for (int i = 0; i < g_n_hk_keys; i++)
+        hotkey_set(fwd, i, bit_test(fwd->keybit, g_hk_codes[i]) && bit_test(keys, g_hk_codes[i]));
+    for (unsigned int code = 0; code < KEY_CNT + ABS_CNT; code++) {
+        struct input_event ev = {0};
+        if (code < KEY_CNT) {
+            if (!bit_test(fwd->keybit, code)) continue;
+            if (g_hk_index[code] && (fwd->hk_swallow >> (g_hk_index[code] - 1) & 1)) continue;
+            ev.type = EV_KEY;
+            ev.code = code;
+            ev.value = bit_test(keys, code);
+        } else {
+            if (!(have >> (code - KEY_CNT) & 1)) continue;
+            ev.type = EV_ABS;
+            ev.code = code - KEY_CNT;
+            ev.value = vals[ev.code];
+        }
+        if (r->active && !remap_apply(r, &ev)) continue;
+        if (ev.type == EV_KEY && ev.code < KEY_CNT && ev.value && !macro_is_trigger(&fwd->profile->macros, ev.code))
+            bit_assign(want, ev.code, true);
+    }
+
+    fwd_sink_t *o = fwd->sink;
+    fwd_flush(fwd, virt_fd);
+    for (unsigned int i = 0; i < NLONGS(KEY_CNT); i++) {
+        unsigned long diff = want[i] ^ fwd->held[i];
+        while (diff) {
+            unsigned int bit = __builtin_ctzl(diff);
+            diff &= diff - 1;
+            struct input_event ev = { .type = EV_KEY, .code = i * BITS_PER_LONG + bit };
+            ev.value = bit_test(want, ev.code);
+            fwd_key(fwd, &ev);
+            if (o->out_len >= FWD_OUT_EVENTS - FWD_FRAME_SLACK) fwd_flush(fwd, virt_fd);
+        }
+    }
+    for (unsigned int code = 0; code < ABS_CNT; code++) {
+        if (!(have >> code & 1)) continue;
+        if (fwd->filter_mask >> code & 1) {
+            fwd->raw[code] = vals[code];
+            fwd->touched |= 1ULL << code;
+            continue;
+        }
+        fwd_output_simple(fwd, EV_ABS, code, fwd_scale(fwd, code, vals[code]));
+        if (o->out_len >= FWD_OUT_EVENTS - FWD_FRAME_SLACK) fwd_flush(fwd, virt_fd);
+    }
+    fwd_filter_commit(fwd);
+    fwd_derive_sync(fwd);
+    if (o->out_len > 0 || o->frame_abs) {
+        fwd_emit_simple(fwd, EV_SYN, SYN_REPORT, 0);
+        fwd_flush(fwd, virt_fd);
+    }
+}
+
+// 向真实设备查询当前按键/摇杆状态并补发差异
+static void fwd_resync(fwd_ctx_t *fwd, int src_fd, int virt_fd) {
+    unsigned long keys[NLONGS(KEY_CNT)] = {0};
+    int32_t vals[ABS_CNT];
+    uint64_t have = 0;
+    if (ioctl(src_fd, EVIOCGKEY(sizeof(keys)), keys) < 0) return;
+
+    for (unsigned int code = 0; code < ABS_CNT; code++) {
+        struct input_absinfo ai;
+        if (!bit_test(fwd->absbit, code) || ioctl(src_fd, EVIOCGABS(code), &ai) < 0) continue;
+        vals[code] = ai.value;
+        have |= 1ULL << code;
+    }
+    fwd_sync_state(fwd, keys, vals, have, virt_fd);
+}
+
+// 真实设备断开: 丢弃没收完的半帧, 松开所有按键、摇杆回中, 避免游戏里卡键
+static void fwd_release(fwd_ctx_t *fwd, int virt_fd) {
+    static const unsigned long none[NLONGS(KEY_CNT)];
+    uint64_t have = 0;
+    for (unsigned int code = 0; code < ABS_CNT; code++)
+        if (bit_test(fwd->absbit, code)) have |= 1ULL << code;
+
+    fwd->head = fwd->tail = fwd->scan = 0;
+    fwd->dropping = false;
+    fwd->touched = 0;
+    fwd_sync_state(fwd, none, fwd->abs_rest, have, virt_fd);
+}
+
+static void fwd_set_profile(fwd_ctx_t *fwd, const profile_t *profile, bool primary) {
+    fwd->profile = profile;
+    fwd->filter_mask = primary ? profile->filter.mask : 0;
+    fwd->sink->macros = &profile->macros;
+}
+
+// 对比真实设备与虚拟手柄的量程, 只为不同的轴生成换算参数; 每次 (重新) 连接都要算
+static void fwd_bind_ranges(fwd_ctx_t *fwd, int src_fd, const struct input_absinfo *pad_abs) {
+    fwd->scale_mask = 0;
+    for (int code = 0; pad_abs && code < ABS_CNT; code++) {
+        struct input_absinfo ai;
+        const struct input_absinfo *out = &pad_abs[code];
+        if (!bit_test(fwd->absbit, code) || ioctl(src_fd, EVIOCGABS(code), &ai) < 0) continue;
+        if (out->maximum <= out->minimum || ai.maximum <= ai.minimum) continue;
+        if (ai.minimum == out->minimum && ai.maximum == out->maximum) continue;
+        fwd->scale[code].in_min = ai.minimum;
+        fwd->scale[code].out_min = out->minimum;
+        fwd->scale[code].out_max = out->maximum;
+        fwd->scale[code].k = (int32_t)((((int64_t)out->maximum - out->minimum) << 16) /
+                                       ((int64_t)ai.maximum - ai.minimum));
+        fwd->scale_mask |= 1ULL << code;
+    }
+}
+
+static void fwd_init(fwd_ctx_t *fwd, int src_fd, fwd_sink_t *sink, const profile_t *profile, bool primary) {
+    memset(fwd, 0, sizeof(*fwd));
+    ioctl(src_fd, EVIOCGBIT(EV_ABS, sizeof(fwd->absbit)), fwd->absbit);
+    ioctl(src_fd, EVIOCGBIT(EV_KEY, sizeof(fwd->keybit)), fwd->keybit);
+    fwd->sink = sink;
+    fwd_set_profile(fwd, profile, primary);
+    // 静止值与滤波的判断一致: 有符号量程或校准过中心的轴回中, 其余 (扳机) 回到最小值
+    for (int code = 0; code < ABS_CNT; code++) {
+        const axis_param_t *p = &g_cfg.axis[code];
+        struct input_absinfo ai;
+        if (!bit_test(fwd->absbit, code) || ioctl(src_fd, EVIOCGABS(code), &ai) < 0) continue;
+        if (p->calibrated) fwd->abs_rest[code] = p->cal_center;
+        else fwd->abs_rest[code] = ai.minimum < 0 ? ai.minimum + (ai.maximum - ai.minimum) / 2 : ai.minimum;
+    }
+    fwd_bind_ranges(fwd, src_fd, g_pad.abs);
+}
+
+// 把 [tail, end) 这一完整帧搬进输出批; 滤波后什么都没剩的帧连 SYN 一起丢掉.
+// 限速时轴值先攒在输出批外, 这样的帧仍要送出 SYN, 由它决定输出还是设定 TIMER_ABS
+static void fwd_take_frame(fwd_ctx_t *fwd, uint32_t end, int virt_fd) {
+    fwd_sink_t *o = fwd->sink;
+    uint32_t n = end - fwd->tail;
+    if (o->out_len + n + FWD_FRAME_SLACK > FWD_OUT_EVENTS) fwd_flush(fwd, virt_fd);
+    fwd->n_frames++;
+
+    uint32_t start = o->out_len;
+    for (; fwd->tail != end; fwd->tail++) {
+        const struct input_event *ev = &fwd->ring[fwd->tail & (FWD_RING_EVENTS - 1)];
+        if (fwd_filtered(fwd, ev)) {
+            fwd->raw[ev->code] = ev->value;
+            fwd->touched |= 1ULL << ev->code;
+        } else if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+            fwd_filter_commit(fwd);
+            if (o->out_len != start || o->frame_abs) fwd_emit(fwd, ev);
+        } else {
+            fwd_input(fwd, ev);
+        }
+    }
+}
+
+// 扫描新读入的事件, 切出完整帧; 未完成的帧留在环里等待后续数据
+static void fwd_scan(fwd_ctx_t *fwd, int src_fd, int virt_fd) {
+    for (; fwd->scan != fwd->head; fwd->scan++) {
+        const struct input_event *ev = &fwd->ring[fwd->scan & (FWD_RING_EVENTS - 1)];
+        if (ev->type != EV_SYN) continue;
+
+        if (ev->code == SYN_DROPPED) {
+            // 内核缓冲溢出: 当前帧已不完整, 丢弃到下一个 SYN_REPORT
+            STAT_ADD(syn_dropped, 1);
+            fwd->dropping = true;
+            fwd->tail = fwd->scan + 1;
+        } else if (ev->code == SYN_REPORT) {
+            if (fwd->dropping) {
+                fwd->dropping = false;
+                fwd->tail = fwd->scan + 1;
+                fwd_resync(fwd, src_fd, virt_fd);
+            } else {
+                fwd_take_frame(fwd, fwd->scan + 1, virt_fd);
+            }
+        }
+    }
+
+    if (fwd->dropping) {
+        fwd->tail = fwd->scan;
+    } else if (fwd->head - fwd->tail == FWD_RING_EVENTS) {
+        // 整个环都没有 SYN_REPORT (不应发生), 原样送出避免卡死
+        fwd_take_frame(fwd, fwd->head, virt_fd);
+    }
+}
+
+// 一次 readv 尽量填满环的空闲部分, 返回读到的事件数, 出错返回 -1
+static int fwd_fill(fwd_ctx_t *fwd, int src_fd, bool *drained) {
+    uint32_t space = FWD_RING_EVENTS - (fwd->head - fwd->tail);
+    uint32_t pos = fwd->head & (FWD_RING_EVENTS - 1);
+    uint32_t first = FWD_RING_EVENTS - pos;
+    if (first > space) first = space;
+
+    struct iovec iov[2] = {
+        { &fwd->ring[pos], first * sizeof(struct input_event) },
+        { &fwd->ring[0], (space - first) * sizeof(struct input_event) },
+    };
+    ssize_t r = readv(src_fd, iov, space > first ? 2 : 1);
+    fwd->n_reads++;
+    if (r < 0) {
+        *drained = true;
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    uint32_t n = (uint32_t)r / sizeof(struct input_event);
+    if (g_cfg.latency) lat_record(&g_lat_read, fwd->ring, pos, n, FWD_RING_EVENTS - 1);
+    fwd->head += n;
+    *drained = n < space;
+    return (int)n;
+}
+
+// 读空真实设备, 完整帧放入输出批; 同一次唤醒里各来源的帧按来源顺序整帧排列, 不会交错
+static int fwd_drain(fwd_ctx_t *fwd, int src_fd, int virt_fd) {
+    bool drained = false;
+    while (!drained) {
+        if (fwd_fill(fwd, src_fd, &drained) < 0) return -1;
+        fwd_scan(fwd, src_fd, virt_fd);
+    }
+    return 0;
+}
+
+// 单一来源: 读空后合并为一次 write 发给 uinput
+static int fwd_pump(fwd_ctx_t *fwd, int src_fd, int virt_fd) {
+    int ret = fwd_drain(fwd, src_fd, virt_fd);
+    int err = errno;
+    fwd_flush(fwd, virt_fd);
+    errno = err;
+    return ret;
+}
+
+/* ============================================================
+ * 事件循环: epoll + 边沿触发, 每个 fd 挂一个处理函数, 每次唤醒只处理就绪的 fd.
+ * 边沿触发要求处理函数把 fd 读到 EAGAIN (或读到不满缓冲区) 为止
+ * ============================================================ */
+#define LOOP_MAX_EVENTS 16
+
+typedef struct {
+    void (*fn)(void *ctx, uint32_t events);
+    void *ctx;
+    bool want_out;         // 已额外登记 EPOLLOUT
+} loop_handler_t;
+
+static int g_loop_fd = -1;
+
+static int loop_add(int fd, loop_handler_t *h) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = h };
+    return epoll_ctl(g_loop_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// 输出积压时额外等 EPOLLOUT, 清空后撤掉
+static void loop_want_write(int fd, loop_handler_t *h, bool on) {
+    if (on == h->want_out) return;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0), .data.ptr = h };
+    epoll_ctl(g_loop_fd, EPOLL_CTL_MOD, fd, &ev);
+    h->want_out = on;
+}
+
+static void loop_del(int fd) {
+    epoll_ctl(g_loop_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// 等待并分发一轮事件; 被信号打断返回 0
+static int loop_run_once(void) {
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    int n = epoll_wait(g_loop_fd, evs, LOOP_MAX_EVENTS, -1);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    STAT_ADD(wakeups, 1);
+    for (int i = 0; i < n; i++) {
+        loop_handler_t *h = evs[i].data.ptr;
+        h->fn(h->ctx, evs[i].events);
+    }
+    return n;
+}
+
+/* ============================================================
+ * 输入来源: 主设备 trimui_raw 加上 --source 指定的附加设备, 合并进 Player1;
+ * --player2 指定的设备 (蓝牙/USB 手柄等) 合并进 Player2, 两个虚拟手柄共用一个事件循环.
+ * inotify 监视 /dev/input, 断开的设备重新出现后再抓取, 虚拟手柄全程不销毁
+ * ============================================================ */
+#define SRC_MAX 8
+
+typedef struct {
+    const char *path;
+    int fd;                // 断开时为 -1
+    int pad;               // 输出到哪个虚拟手柄 (g_pads 下标)
+    fwd_ctx_t fwd;         // fwd.sink 为 NULL 表示还从未连上过
+    loop_handler_t handler;
+} source_t;
+
+// g_sources[0] 固定为主设备
+static source_t g_sources[SRC_MAX] = { { .path = REAL_DEV_PATH, .fd = -1 } };
+static int g_n_sources = 1;
+
+// 每个虚拟手柄一份输出批和 FF 处理. Player1 的震动交给板载马达;
+// Player2 的转给它的来源设备自己的 FF, 效果按虚拟手柄上的编号保存, 设备 (重新) 连上时重新上传
+typedef struct {
+    int virt_fd;           // 未创建时为 -1
+    fwd_sink_t sink;
+    loop_handler_t handler;
+    rumble_engine_t *rumble;   // NULL 表示转发 FF
+    int ff_src;            // 接收震动的来源 (g_sources 下标), -1 表示没有连上的
+    uint32_t ff_used;      // 已上传的效果 (虚拟编号)
+    int16_t ff_id[RUMBLE_MAX_EFFECTS];        // 在来源设备上的编号, -1 表示未上传
+    struct ff_effect ff[RUMBLE_MAX_EFFECTS];
+} pad_t;
+
+static pad_t g_pads[PAD_MAX] = { { .virt_fd = -1, .ff_src = -1 }, { .virt_fd = -1, .ff_src = -1 } };
+static int g_n_pads = 1;
+
+static void pads_destroy(void) {
+    for (int i = 0; i < g_n_pads; i++) {
+        if (g_pads[i].virt_fd < 0) continue;
+        ioctl(g_pads[i].virt_fd, UI_DEV_DESTROY);
+        close(g_pads[i].virt_fd);
+        g_pads[i].virt_fd = -1;
+    }
+}
+
+// 要转发震动的来源需要写权限, 打不开时退回只读
+static int src_open(const char *path, bool rw) {
+    int fd = rw ? open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC) : -1;
+    if (fd < 0) fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    // 依然执行 Grab，防止意外泄漏
+    ioctl(fd, EVIOCGRAB, 1);
+
+    // 延迟统计和录制需要与 CLOCK_MONOTONIC 可比的事件时间戳
+    if (g_cfg.latency || g_cfg.record_path) {
+        int clk = CLOCK_MONOTONIC;
+        if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0)
+            fprintf(stderr, "WARN: EVIOCSCLOCKID failed, event timestamps are not monotonic\n");
+    }
+    return fd;
+}
+
+// 主设备所在目录, 其中断开着的来源出现时重新打开
+static char g_hotplug_dir[256];
+static size_t g_hotplug_dir_len;
+
+static int hotplug_init(void) {
+    const char *path = g_sources[0].path, *slash = strrchr(path, '/');
+    g_hotplug_dir_len = slash ? (size_t)(slash - path) : 0;
+    if (g_hotplug_dir_len >= sizeof(g_hotplug_dir)) return -1;
+    memcpy(g_hotplug_dir, path, g_hotplug_dir_len);
+    g_hotplug_dir[g_hotplug_dir_len] = '\0';
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return -1;
+    const char *dir = g_hotplug_dir[0] ? g_hotplug_dir : slash ? "/" : ".";
+    if (inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 只关心监视目录下、当前断开着的来源
+static bool hotplug_match(const char *name) {
+    for (int i = 0; i < g_n_sources; i++) {
+        const char *path = g_sources[i].path, *slash = strrchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : 0;
+        if (g_sources[i].fd < 0 && len == g_hotplug_dir_len && strncmp(path, g_hotplug_dir, len) == 0 &&
+            strcmp(slash ? slash + 1 : path, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// 读空 inotify 事件, 返回其中是否有断开着的来源出现
+static bool hotplug_drain(int ino_fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool hit = false;
+    ssize_t n;
+    while ((n = read(ino_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ie = (const struct inotify_event *)p;
+            if (ie->len && hotplug_match(ie->name)) hit = true;
+            p += sizeof(*ie) + ie->len;
+        }
+    }
+    return hit;
+}
+
+// 启动时主设备还没出现 (start_proxy.sh 尚未执行完): 阻塞等待, 不再与脚本抢时序
+static int src_wait(int ino_fd, const char *path) {
+    struct pollfd pfd = { ino_fd, POLLIN, 0 };
+    int fd;
+    while ((fd = src_open(path, false)) < 0 && keep_running) {
+        if (poll(&pfd, 1, -1) > 0) hotplug_drain(ino_fd);
+    }
+    return fd;
+}
+
+// 接收震动的来源断开后改用同一手柄上另一个连着的来源, 已上传的效果重新上传过去
+static void pad_ff_rebind(pad_t *pad) {
+    if (pad->rumble || (pad->ff_src >= 0 && g_sources[pad->ff_src].fd >= 0)) return;
+    pad->ff_src = -1;
+    for (int i = 0; i < g_n_sources && pad->ff_src < 0; i++)
+        if (&g_pads[g_sources[i].pad] == pad && g_sources[i].fd >= 0) pad->ff_src = i;
+    for (int id = 0; id < RUMBLE_MAX_EFFECTS; id++) {
+        pad->ff_id[id] = -1;
+        if (pad->ff_src < 0 || !(pad->ff_used >> id & 1)) continue;
+        struct ff_effect eff = pad->ff[id];
+        eff.id = -1;
+        if (ioctl(g_sources[pad->ff_src].fd, EVIOCSFF, &eff) == 0) pad->ff_id[id] = eff.id;
+    }
+}
+
+// 来源没连上时先记下, 连上后再上传
+static int pad_ff_upload(pad_t *pad, const struct ff_effect *eff) {
+    if (eff->id < 0 || eff->id >= RUMBLE_MAX_EFFECTS) return -EINVAL;
+    if (pad->ff_src >= 0) {
+        struct ff_effect dev = *eff;
+        dev.id = pad->ff_id[eff->id];
+        if (ioctl(g_sources[pad->ff_src].fd, EVIOCSFF, &dev) < 0) return -errno;
+        pad->ff_id[eff->id] = dev.id;
+    }
+    pad->ff[eff->id] = *eff;
+    pad->ff_used |= 1U << eff->id;
+    return 0;
+}
+
+static void pad_ff_erase(pad_t *pad, int id) {
+    if (id < 0 || id >= RUMBLE_MAX_EFFECTS) return;
+    if (pad->ff_src >= 0 && pad->ff_id[id] >= 0) ioctl(g_sources[pad->ff_src].fd, EVIOCRMFF, pad->ff_id[id]);
+    pad->ff_id[id] = -1;
+    pad->ff_used &= ~(1U << id);
+}
+
+// 播放/停止 (code 为虚拟编号) 或 FF_GAIN, 按 evdev 的写接口原样转给来源
+static void pad_ff_write(pad_t *pad, int code, int value) {
+    if (pad->ff_src < 0) return;
+    if (code != FF_GAIN) {
+        if (code < 0 || code >= RUMBLE_MAX_EFFECTS || pad->ff_id[code] < 0) return;
+        code = pad->ff_id[code];
+    }
+    struct input_event ev = { .type = EV_FF, .code = code, .value = value };
+    write(g_sources[pad->ff_src].fd, &ev, sizeof(ev));
+}
+
+// 交还设备并松开它按住的键
+static void src_close(source_t *src) {
+    loop_del(src->fd);
+    ioctl(src->fd, EVIOCGRAB, 0);
+    close(src->fd);
+    src->fd = -1;
+    fwd_release(&src->fwd, g_pads[src->pad].virt_fd);
+    pad_ff_rebind(&g_pads[src->pad]);
+}
+
+static void src_detach(source_t *src) {
+    fprintf(stderr, "WARN: %s went away, waiting for it to come back\n", src->path);
+    src_close(src);
+}
+
+// 抓取设备并按真实状态补发; 方案沿用启动时编译的 (同一块硬件)
+static bool src_attach(source_t *src, const profile_t *profile) {
+    pad_t *pad = &g_pads[src->pad];
+    int fd = src_open(src->path, !pad->rumble);
+    if (fd < 0) return false;
+    src->fd = fd;
+    if (!src->fwd.sink) fwd_init(&src->fwd, fd, &pad->sink, profile, src == &g_sources[0]);
+    else fwd_bind_ranges(&src->fwd, fd, g_pad.abs);
+    fwd_resync(&src->fwd, fd, pad->virt_fd);
+    loop_add(fd, &src->handler);
+    pad_ff_rebind(pad);
+    return true;
+}
+
+/* ============================================================
+ * 组合键动作: 在一轮事件分发之后执行, 此时组合里其余的键可能还按在别的来源上
+ * ============================================================ */
+static int g_hk_sock = -1;
+
+static void hotkey_run(const hotkey_t *h) {
+    if (h->action == HOTKEY_EXEC) {
+        char *argv[] = { (char *)h->path, NULL };
+        pid_t pid;
+        // 本进程忽略 SIGCHLD 由内核自动回收, 脚本里的 wait 需要默认处理
+        posix_spawnattr_t attr;
+        sigset_t def;
+        sigemptyset(&def);
+        sigaddset(&def, SIGCHLD);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigdefault(&attr, &def);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+        int err = posix_spawn(&pid, h->path, NULL, &attr, argv, environ);
+        posix_spawnattr_destroy(&attr);
+        if (err) fprintf(stderr, "WARN: hotkey %s: %s\n", h->path, strerror(err));
+        return;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(h->path) >= sizeof(addr.sun_path)) return;
+    strcpy(addr.sun_path, h->path);
+    if (g_hk_sock < 0) g_hk_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_hk_sock >= 0 && sendto(g_hk_sock, h->msg, strlen(h->msg), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        fprintf(stderr, "WARN: hotkey send to %s: %s\n", h->path, strerror(errno));
+}
+
+// 屏蔽的组合: 之前已经输出的键补发松开, 之后直到松开都吞掉. 组合只在同一个虚拟手柄的来源之间成立
+static void hotkey_dispatch(fwd_sink_t *o) {
+    uint32_t fire = o->hk_fire;
+    o->hk_fire = 0;
+    while (fire) {
+        const hotkey_t *h = &g_hotkeys[__builtin_ctz(fire)];
+        fire &= fire - 1;
+        uint32_t start = o->out_len;
+        for (int i = 0; !h->pass && i < g_n_sources; i++) {
+            fwd_ctx_t *fwd = &g_sources[i].fwd;
+            uint64_t m = fwd->hk_held & h->mask & ~fwd->hk_swallow;
+            if (fwd->sink != o) continue;
+            fwd->hk_swallow |= m;
+            for (; m; m &= m - 1)
+                fwd_output_simple(fwd, EV_KEY, g_hk_codes[__builtin_ctzll(m)], 0);
+        }
+        if (o->out_len != start) sink_emit_simple(o, EV_SYN, SYN_REPORT, 0);
+        hotkey_run(h);
+    }
+}
+
+static void hotkey_close(void) {
+    if (g_hk_sock >= 0) close(g_hk_sock);
+    g_hk_sock = -1;
+}
+
+/* ============================================================
+ * 电源状态: 一段时间无输入无震动进入空闲, 交还马达;
+ * 系统休眠前后由 sleep 钩子经控制 socket 通知, 挂起时连输入设备一起交还, 恢复后重新抓取
+ * ============================================================ */
+enum { POWER_ACTIVE, POWER_IDLE, POWER_SUSPENDED };
+
+static const char *const g_power_names[] = { "active", "idle", "suspended" };
+static int g_power = POWER_ACTIVE;
+static uint64_t g_ff_events;      // 收到的 FF 指令数, 与输出批数一起作为活动计数
+static uint64_t g_idle_mark;      // 上次设定空闲定时器时的活动计数
+
+static inline uint64_t power_activity(void) {
+    uint64_t n = g_ff_events;
+    for (int i = 0; i < g_n_pads; i++) n += g_pads[i].sink.n_writes;
+    return n;
+}
+
+// 空闲定时器只在到期时检查活动计数, 转发路径上不需要每帧重设
+static void power_arm_idle(void) {
+    if (g_cfg.idle_timeout <= 0) return;
+    struct timespec due;
+    timespec_now(&due);
+    timespec_add_ms(&due, (unsigned int)g_cfg.idle_timeout * 1000);
+    timer_set(TIMER_IDLE, &due);
+    g_idle_mark = power_activity();
+}
+
+static void power_idle_check(rumble_engine_t *eng) {
+    if (power_activity() != g_idle_mark) {
+        power_arm_idle();
+        return;
+    }
+    timer_clear(TIMER_IDLE);
+    g_power = POWER_IDLE;
+    rumble_engine_release(eng, false);
+}
+
+static inline void power_wake(void) {
+    if (g_power != POWER_IDLE) return;
+    g_power = POWER_ACTIVE;
+    power_arm_idle();
+}
+
+static void power_suspend(rumble_engine_t *eng) {
+    if (g_power == POWER_SUSPENDED) return;
+    for (int i = 0; i < g_n_sources; i++)
+        if (g_sources[i].fd >= 0) src_close(&g_sources[i]);
+    for (int i = 0; i < g_n_pads; i++) {
+        macro_reset(&g_pads[i].sink, g_pads[i].virt_fd);
+        sink_flush(&g_pads[i].sink, g_pads[i].virt_fd);
+    }
+    rumble_engine_release(eng, true);
+    timer_clear(TIMER_IDLE);
+    g_power = POWER_SUSPENDED;
+    printf("Suspended\n");
+}
+
+// 休眠期间设备可能被重新枚举, 一律重新打开; 不在的交给热插拔
+static void power_resume(void) {
+    if (g_power != POWER_SUSPENDED) return;
+    g_power = POWER_ACTIVE;
+    for (int i = 0; i < g_n_sources; i++)
+        if (g_sources[i].fd < 0) src_attach(&g_sources[i], g_sources[0].fwd.profile);
+    power_arm_idle();
+    printf("Resumed\n");
+}
+
+/* ============================================================
+ * 控制 socket: 前端/启动器按游戏切换方案, 一个数据报一条文本指令
+ *   profile NAME   切换方案
+ *   list           列出全部方案
+ *   status         当前方案和电源状态
+ *   suspend/resume 系统休眠前/恢复后由 sleep 钩子发送
+ * 发送方绑定了地址时回复 "ok ..." / "err ..."
+ * ============================================================ */
+static int ctl_open(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    // 只删除上次留下的 socket, 不跟随符号链接
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    // 权限在 bind 创建时由 umask 决定, 事后不再按路径 chmod
+    mode_t old_mask = umask(0777 & ~CONTROL_SOCK_MODE);
+    int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (r < 0) {
+        close(fd);
+        return -1;
+    }
+    // 启动器不一定以 root 运行, 把它所在的组设为属组
+    if (g_cfg.control_gid != (gid_t)-1 &&
+        fchownat(AT_FDCWD, path, (uid_t)-1, g_cfg.control_gid, AT_SYMLINK_NOFOLLOW) < 0)
+        fprintf(stderr, "WARN: Cannot set group of %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+static void ctl_close(int fd, const char *path) {
+    if (fd < 0) return;
+    close(fd);
+    unlink(path);
+}
+
+// 切换发生在两次 fwd_drain 之间, 不会把一帧拆到两个方案里
+// 先停掉旧方案的连发/宏, 再按新方案补发状态, 补发时新方案启动的连发不会被清掉
+static void profile_switch(rumble_engine_t *eng, const profile_t *p) {
+    if (p == g_sources[0].fwd.profile) return;
+    for (int i = 0; i < g_n_pads; i++) macro_reset(&g_pads[i].sink, g_pads[i].virt_fd);
+    for (int i = 0; i < g_n_sources; i++) {
+        source_t *src = &g_sources[i];
+        if (!src->fwd.sink) continue;
+        fwd_set_profile(&src->fwd, p, i == 0);
+        if (src->fd >= 0) fwd_resync(&src->fwd, src->fd, g_pads[src->pad].virt_fd);
+    }
+    for (int i = 0; i < g_n_pads; i++) sink_flush(&g_pads[i].sink, g_pads[i].virt_fd);
+    rumble_engine_scale(eng, p->rumble_scale);
+    printf("Profile: %s\n", p->name);
+}
+
+static void ctl_handle(int ctl_fd, rumble_engine_t *eng) {
+    char buf[128], reply[PROFILE_MAX * PROFILE_NAME_MAX + 8];
+    struct sockaddr_un peer;
+    socklen_t peer_len;
+    ssize_t n;
+    while ((peer_len = sizeof(peer)),
+           (n = recvfrom(ctl_fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&peer, &peer_len)) >= 0) {
+        while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r' || buf[n - 1] == ' ')) n--;
+        buf[n] = '\0';
+
+        if (strncmp(buf, "profile ", 8) == 0) {
+            const profile_t *p = profile_find(buf + 8);
+            if (p) profile_switch(eng, p);
+            snprintf(reply, sizeof(reply), p ? "ok %s" : "err unknown profile %s", buf + 8);
+        } else if (strcmp(buf, "list") == 0) {
+            int len = snprintf(reply, sizeof(reply), "ok");
+            for (int i = 0; i < g_n_profiles; i++)
+                len += snprintf(reply + len, sizeof(reply) - len, " %s", g_profiles[i]->name);
+        } else if (strcmp(buf, "status") == 0) {
+            snprintf(reply, sizeof(reply), "ok %s %s", g_sources[0].fwd.profile->name, g_power_names[g_power]);
+        } else if (strcmp(buf, "suspend") == 0) {
+            power_suspend(eng);
+            snprintf(reply, sizeof(reply), "ok");
+        } else if (strcmp(buf, "resume") == 0) {
+            power_resume();
+            snprintf(reply, sizeof(reply), "ok");
+        } else {
+            snprintf(reply, sizeof(reply), "err unknown command");
+        }
+        if (peer_len > sizeof(sa_family_t))
+            sendto(ctl_fd, reply, strlen(reply), MSG_DONTWAIT, (struct sockaddr *)&peer, peer_len);
+    }
+}
+
+/* ============================================================
+ * 回放 (--replay FILE): 按原始节奏把录制的事件写入新建的虚拟手柄
+ * ============================================================ */
+#define REPLAY_SETTLE_MS 1000   // 等前端发现新手柄后再开始
+
+typedef struct {
+    uint32_t off;
+    uint32_t left;
+    int64_t t_us;
+} rec_cursor_t;
+
+typedef struct {
+    int kind;
+    int64_t t_us;
+    struct input_event ev;
+    rumble_cmd_t cmd;
+} rec_entry_t;
+
+static bool rec_next(rec_cursor_t *c, rec_entry_t *out) {
+    const rec_header_t *h = g_rec.hdr;
+    if (c->left == 0) return false;
+    if (c->off >= h->capacity || g_rec.data[c->off] == 0) c->off = 0;
+
+    uint32_t len = g_rec.data[c->off];
+    if (len < 3 || c->off + len > h->capacity) return false;
+    const uint8_t *p = g_rec.data + c->off + 2, *end = g_rec.data + c->off + len;
+    uint64_t v, code, value;
+    size_t n;
+
+    if (!(n = rec_get_varint(p, end, &v))) return false;
+    p += n;
+    c->t_us += (int64_t)v;
+    out->kind = g_rec.data[c->off + 1];
+    out->t_us = c->t_us;
+
+    memset(&out->ev, 0, sizeof(out->ev));
+    memset(&out->cmd, 0, sizeof(out->cmd));
+    if (p >= end) return false;
+    int op = *p++;
+    if (!(n = rec_get_varint(p, end, &code))) return false;
+    p += n;
+    if (!(n = rec_get_varint(p, end, &value))) return false;
+    p += n;
+
+    if (out->kind == REC_EVENT) {
+        out->ev.type = op;
+        out->ev.code = (uint16_t)code;
+        out->ev.value = (int32_t)rec_unzigzag(value);
+    } else if (out->kind == REC_FF) {
+        out->cmd.op = op;
+        out->cmd.id = (int)rec_unzigzag(code);
+        out->cmd.value = (int)rec_unzigzag(value);
+        if (op == RUMBLE_CMD_UPLOAD) {
+            if ((size_t)(end - p) < sizeof(out->cmd.effect)) return false;
+            memcpy(&out->cmd.effect, p, sizeof(out->cmd.effect));
+        }
+    }
+    c->off += len;
+    c->left--;
+    return true;
+}
+
+static void sleep_until(const struct timespec *ts) {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL) == EINTR && keep_running)
+        ;
+}
+
+static int replay_run(const char *path) {
+    if (rec_map(path, false) < 0) {
+        fprintf(stderr, "FATAL: %s is not a record file\n", path);
+        return 1;
+    }
+    pad_desc_stock(&g_pad);
+    int virt_fd = pad_create(&g_pad);
+    if (virt_fd < 0) {
+        perror("Virtual creation failed");
+        return 1;
+    }
+    motor_init();
+    static rumble_ctx_t rumble;
+    rumble_init(&rumble);
+
+    rec_cursor_t cur = { g_rec.hdr->tail, g_rec.hdr->count, 0 };
+    printf("Replaying %u records from %s.\n", cur.left, path);
+
+    struct timespec base;
+    timespec_now(&base);
+    timespec_add_ms(&base, REPLAY_SETTLE_MS);
+
+    struct input_event frame[FWD_OUT_EVENTS];
+    uint32_t n = 0;
+    int64_t t0 = -1;
+    rec_entry_t e;
+    while (keep_running && rec_next(&cur, &e)) {
+        if (t0 < 0) t0 = e.t_us;
+        struct timespec target = base;
+        target.tv_sec += (e.t_us - t0) / 1000000;
+        timespec_add_ns(&target, (long)((e.t_us - t0) % 1000000) * 1000);
+
+        // 等待期间照常推进震动 PWM
+        for (;;) {
+            struct timespec now, wake;
+            timespec_now(&now);
+            if (timespec_passed(&target, &now) || !keep_running) break;
+            bool more = rumble_tick(&rumble, &now, &wake);
+            sleep_until(more ? timespec_min(&wake, &target) : &target);
+        }
+
+        if (e.kind == REC_EVENT) {
+            e.ev.input_event_sec = 0;
+            e.ev.input_event_usec = 0;
+            frame[n++] = e.ev;
+            if ((e.ev.type == EV_SYN && e.ev.code == SYN_REPORT) || n == FWD_OUT_EVENTS) {
+                write(virt_fd, frame, n * sizeof(frame[0]));
+                n = 0;
+            }
+        } else if (e.kind == REC_FF) {
+            rumble_apply(&rumble, &e.cmd);
+        }
+    }
+
+    motor_close();
     ioctl(virt_fd, UI_DEV_DESTROY);
     close(virt_fd);
+    munmap(g_rec.hdr, g_rec.map_len);
+    g_rec.hdr = NULL;
+    return 0;
+}
+
+/* ============================================================
+ * 基准测试 (--bench [TRACE]): 不需要真机, uinput/GPIO 都接到空设备
+ * ============================================================ */
+#define BENCH_SYNTH_FRAMES  100000
+#define BENCH_RUMBLE_ROUNDS 2000
+#define BENCH_ABS_RATE      60     // 限速用例的 --abs-rate
+#define BENCH_ABS_FRAMES    1000   // 限速用例的输入帧数, 每 4 ms 一帧
+
+static uint64_t g_bench_gpio_writes;
+static int g_bench_gpio_state;   // 假 GPIO 的当前电平, 压力测试据此检查马达
+
+static void bench_gpio_write(int fd, int state) {
+    (void)fd;
+    g_bench_gpio_state = state;
+    g_bench_gpio_writes++;
+}
+
+static const gpio_backend_t g_bench_gpio = { "bench", NULL, bench_gpio_write };
+
+static uint64_t bench_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 合成数据: 双摇杆画圈 + 每 8 帧一次按键翻转, 接近真实游戏时的事件密度
+static struct input_event *bench_synth_trace(size_t *count) {
+    size_t cap = BENCH_SYNTH_FRAMES * 6, n = 0;
+    struct input_event *evs = calloc(cap, sizeof(*evs));
+    if (!evs) return NULL;
+    for (int f = 0; f < BENCH_SYNTH_FRAMES; f++) {
+        int phase = (f * 37) % 360 - 180;
+        int x = phase * 182, y = (90 - abs(phase)) * 364;
+        evs[n++] = (struct input_event){ .type = EV_ABS, .code = ABS_X,  .value = x };
+        evs[n++] = (struct input_event){ .type = EV_ABS, .code = ABS_Y,  .value = y };
+        evs[n++] = (struct input_event){ .type = EV_ABS, .code = ABS_RX, .value = -y };
+        evs[n++] = (struct input_event){ .type = EV_ABS, .code = ABS_RY, .value = x };
+        if (f % 8 == 0)
+            evs[n++] = (struct input_event){ .type = EV_KEY, .code = BTN_SOUTH, .value = (f / 8) & 1 };
+        evs[n++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT };
+    }
+    *count = n;
+    return evs;
+}
+
+static struct input_event *bench_load_trace(const char *path, size_t *count) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    struct input_event *evs = size > 0 ? malloc(size) : NULL;
+    *count = evs ? fread(evs, sizeof(*evs), size / sizeof(*evs), f) : 0;
+    fclose(f);
+    return evs;
+}
+
+// 每次唤醒向管道写入 frames_per_wake 帧, 只统计 fwd_pump 自身的 CPU 时间
+static void bench_forward(const struct input_event *evs, size_t count, int frames_per_wake) {
+    int pipefd[2];
+    int sink = open("/dev/null", O_WRONLY);
+    if (sink < 0 || pipe(pipefd) < 0) return;
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+    static fwd_ctx_t fwd;
+    static fwd_sink_t out;
+    profile_t *profile = profile_compile("bench", NULL, NULL);
+    if (!profile) return;
+    profile_bind(profile, pipefd[0], NULL);
+    memset(&out, 0, sizeof(out));
+    out.timer = TIMER_PAD;
+    out.fd = sink;
+    fwd_init(&fwd, pipefd[0], &out, profile, true);
+
+    uint64_t cpu = 0, wakes = 0;
+    size_t i = 0;
+    while (i < count) {
+        size_t start = i;
+        int frames = 0;
+        while (i < count && frames < frames_per_wake) {
+            if (evs[i].type == EV_SYN && evs[i].code == SYN_REPORT) frames++;
+            i++;
+        }
+        write(pipefd[1], &evs[start], (i - start) * sizeof(*evs));
+
+        uint64_t t0 = bench_cpu_ns();
+        fwd_pump(&fwd, pipefd[0], sink);
+        cpu += bench_cpu_ns() - t0;
+        wakes++;
+    }
+
+    uint64_t frames = fwd.n_frames ? fwd.n_frames : 1;
+    printf("forward  %2d frame/wake: %zu events, %.0f events/s, %.2f syscalls/frame, "
+           "%.0f ns/wakeup\n", frames_per_wake, count,
+           cpu ? count * 1e9 / cpu : 0.0,
+           (double)(fwd.n_reads + out.n_writes) / frames,
+           (double)cpu / wakes);
+    free(profile);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(sink);
+}
+
+// 限速下只有摇杆、没有按键的帧: 虚拟时钟每 4 ms 送一帧, TIMER_ABS 到点按主循环的做法补帧.
+// 输出的帧率应接近限速值, 为 0 说明攒下的轴值卡住了
+static bool bench_abs_rate(void) {
+    int in[2], out_pipe[2];
+    if (pipe(in) < 0) return false;
+    if (pipe(out_pipe) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+    fcntl(in[0], F_SETFL, O_NONBLOCK);
+    fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(out_pipe[1], F_SETFL, O_NONBLOCK);
+
+    static fwd_ctx_t fwd;
+    static fwd_sink_t out;
+    profile_t *profile = profile_compile("bench", NULL, NULL);
+    bool ok = profile != NULL;
+    uint64_t frames_out = 0, axes_out = 0;
+    if (ok) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long saved_interval = g_abs_interval_ns;
+        g_clock_override = &now;
+        g_abs_interval_ns = 1000000000L / BENCH_ABS_RATE;
+        profile_bind(profile, in[0], NULL);
+        memset(&out, 0, sizeof(out));
+        out.timer = TIMER_PAD;
+        out.fd = out_pipe[1];
+        fwd_init(&fwd, in[0], &out, profile, true);
+
+        for (int f = 0; f < BENCH_ABS_FRAMES; f++) {
+            int phase = (f * 37) % 360 - 180;
+            struct input_event evs[] = {
+                { .type = EV_ABS, .code = ABS_X, .value = phase * 182 },
+                { .type = EV_ABS, .code = ABS_Y, .value = (90 - abs(phase)) * 364 },
+                { .type = EV_SYN, .code = SYN_REPORT },
+            };
+            write(in[1], evs, sizeof(evs));
+            fwd_pump(&fwd, in[0], out.fd);
+            timespec_add_ms(&now, 4);
+            if (timer_due(out.timer + TIMER_ABS, &now)) {
+                timer_clear(out.timer + TIMER_ABS);
+                sink_emit_simple(&out, EV_SYN, SYN_REPORT, 0);
+                sink_flush(&out, out.fd);
+            }
+            struct input_event ev;
+            while (read(out_pipe[0], &ev, sizeof(ev)) == sizeof(ev)) {
+                frames_out += ev.type == EV_SYN;
+                axes_out += ev.type == EV_ABS;
+            }
+        }
+        timer_clear(out.timer + TIMER_ABS);
+        g_abs_interval_ns = saved_interval;
+        g_clock_override = NULL;
+        ok = frames_out > 0;
+        double secs = BENCH_ABS_FRAMES * 4 / 1000.0;
+        printf("abs-rate %d Hz, stick-only input at 250 Hz: %.1f frames/s, %.1f axis events/s out%s\n",
+               BENCH_ABS_RATE, frames_out / secs, axes_out / secs, ok ? "" : " (FAIL: axes stuck)");
+    }
+    free(profile);
+    close(in[0]);
+    close(in[1]);
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    return ok;
+}
+
+// 在虚拟时钟上跑 FF 上传/播放序列, 统计唤醒次数、GPIO 写入和每次 tick 的 CPU
+static void bench_rumble(void) {
+    static rumble_ctx_t ctx;
+    struct timespec now, wake;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    g_clock_override = &now;
+    g_gpio_backend = &g_bench_gpio;
+    g_gpio_fd = 0;
+    rumble_init(&ctx);
+
+    uint64_t ticks = 0, cpu = 0, sim_ms = 0;
+    g_bench_gpio_writes = 0;
+    srand(1);
+    for (int round = 0; round < BENCH_RUMBLE_ROUNDS; round++) {
+        // 模拟游戏每 100 ms 更新一次震动, 偶尔叠加第二个效果
+        struct ff_effect e = { .type = FF_RUMBLE, .id = round % 2 };
+        e.u.rumble.strong_magnitude = rand() & 0xffff;
+        e.u.rumble.weak_magnitude = rand() & 0xffff;
+        e.replay.length = 50 + rand() % 200;
+        rumble_upload(&ctx, &e);
+        rumble_play(&ctx, e.id, 1);
+
+        struct timespec end = now;
+        timespec_add_ms(&end, 100);
+        while (timespec_cmp(&now, &end) < 0) {
+            uint64_t t0 = bench_cpu_ns();
+            bool more = rumble_tick(&ctx, &now, &wake);
+            cpu += bench_cpu_ns() - t0;
+            ticks++;
+            if (!more || timespec_cmp(&wake, &end) > 0) wake = end;
+            now = wake;
+        }
+        sim_ms += 100;
+    }
+    rumble_play(&ctx, 0, 0);
+    rumble_play(&ctx, 1, 0);
+    rumble_tick(&ctx, &now, &wake);
+
+    printf("rumble   %llu ms simulated: %.1f wakeups/s, %.1f gpio writes/s, %.0f ns/tick\n",
+           (unsigned long long)sim_ms, ticks * 1000.0 / sim_ms,
+           g_bench_gpio_writes * 1000.0 / sim_ms, ticks ? (double)cpu / ticks : 0.0);
+
+    g_clock_override = NULL;
+    g_gpio_backend = NULL;
+    g_gpio_fd = -1;
+}
+
+// 只有内置方案时, 补上方案目标后的描述必须与原厂描述逐位相同 (不受 --map 等配置影响)
+static bool bench_pad_desc(void) {
+    const char *remap_file = g_cfg.remap_file, *profile_dir = g_cfg.profile_dir;
+    int trigger_keys = g_cfg.trigger_keys[0], stick_dpad = g_cfg.stick_dpad[0];
+    g_cfg.remap_file = g_cfg.profile_dir = NULL;
+    g_cfg.trigger_keys[0] = g_cfg.stick_dpad[0] = 0;
+    profile_t *p = profile_compile("default", NULL, NULL);
+    if (p) profile_add(p);
+    for (size_t i = 0; i < sizeof(g_remap_builtins) / sizeof(g_remap_builtins[0]); i++)
+        if ((p = profile_compile(g_remap_builtins[i], g_remap_builtins[i], NULL)) != NULL)
+            profile_add(p);
+
+    static pad_desc_t stock, pad;
+    pad_desc_stock(&stock);
+    pad = stock;
+    profile_pad_targets(&pad);
+    int keys = 0;
+    for (int code = 0; code < KEY_CNT; code++) keys += bit_test(pad.keybit, code);
+    int extra = pad_desc_extra_keys(&pad, stock.keybit, false);
+    bool ok = extra == 0 && memcmp(pad.absbit, stock.absbit, sizeof(pad.absbit)) == 0;
+    printf("pad      built-in profiles: %d keys declared, %d beyond stock%s\n",
+           keys, extra, ok ? "" : " (FAIL: pad differs from stock)");
+
+    profile_free_all();
+    g_cfg.remap_file = remap_file;
+    g_cfg.profile_dir = profile_dir;
+    g_cfg.trigger_keys[0] = trigger_keys;
+    g_cfg.stick_dpad[0] = stick_dpad;
+    return ok;
+}
+
+static int bench_run(const char *trace) {
+    size_t count = 0;
+    struct input_event *evs = trace ? bench_load_trace(trace, &count) : bench_synth_trace(&count);
+    if (!evs || count == 0) {
+        fprintf(stderr, "FATAL: Cannot load trace %s\n", trace ? trace : "(synthetic)");
+        free(evs);
+        return 1;
+    }
+    printf("trace: %s\n", trace ? trace : "synthetic");
+    bench_forward(evs, count, 1);
+    bench_forward(evs, count, 16);
+    bool ok = bench_pad_desc();
+    ok = bench_abs_rate() && ok;
+    bench_rumble();
+    free(evs);
+    return ok ? 0 : 1;
+}
+
+/* ============================================================
+ * 压力测试 (--stress [N]) 与模糊测试入口 (-DTRIMUI_FUZZ):
+ * 随机的上传/播放/停止/删除/增益序列直接打到 rumble_ctx_t 上, 马达接假 GPIO, 时钟为虚拟时钟.
+ * 每条指令之后按定时器的节奏 tick 并检查不变量: 播放表与槽位一致、没有越界编号、
+ * 马达只在有效果处于播放区间时通电、调度不会原地空转; 结束时全部停止后马达必须断电
+ * ============================================================ */
+#define STRESS_COMMANDS   1000000
+#define STRESS_CMD_BYTES  8      // 一条指令的编码长度, 随机数和模糊输入共用同一个解码
+#define STRESS_MAX_SPINS  8      // 允许连续多少次唤醒不推进时间
+
+typedef struct {
+    rumble_ctx_t ctx;
+    struct timespec now, wake;
+    bool armed;            // 上次 tick 要求再次唤醒
+    int spins;
+    const char *error;     // 第一个违反的不变量
+    uint64_t cmds, ticks;
+    uint64_t cmd_ns, cmd_ns_max;   // 指令 (含随后的一次 tick) 的 CPU 时间
+} stress_t;
+
+static void stress_begin(stress_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->now.tv_sec = 1000;
+    g_clock_override = &st->now;
+    g_gpio_backend = &g_bench_gpio;
+    g_gpio_fd = 0;
+    g_gpio_last_state = -1;
+    g_bench_gpio_state = 0;
+    rumble_init(&st->ctx);
+}
+
+static void stress_end(void) {
+    g_clock_override = NULL;
+    g_gpio_backend = NULL;
+    g_gpio_fd = -1;
+    g_gpio_last_state = -1;
+}
+
+static const char *stress_check(const stress_t *st) {
+    const rumble_ctx_t *ctx = &st->ctx;
+    int playing = 0;
+    bool live = false;
+    if (ctx->n_playing < 0 || ctx->n_playing > RUMBLE_MAX_EFFECTS) return "n_playing out of range";
+    for (int i = 0; i < RUMBLE_MAX_EFFECTS; i++) {
+        const rumble_slot_t *slot = &ctx->slots[i];
+        if (!slot->playing) continue;
+        playing++;
+        if (!slot->in_use) return "erased slot still playing";
+        if (timespec_passed(&slot->start, &st->now) && !timespec_passed(&slot->stop, &st->now)) live = true;
+    }
+    if (playing != ctx->n_playing) return "playing list out of sync with slots";
+    for (int i = 0; i < ctx->n_playing; i++) {
+        if (ctx->playing[i] >= RUMBLE_MAX_EFFECTS || !ctx->slots[ctx->playing[i]].playing)
+            return "bad playing list entry";
+        for (int j = 0; j < i; j++)
+            if (ctx->playing[j] == ctx->playing[i]) return "duplicate playing list entry";
+    }
+    if (ctx->active != (ctx->n_playing > 0)) return "active flag out of sync";
+    if (g_bench_gpio_state && !live) return "motor on with no effect in its play window";
+    return NULL;
+}
+
+static bool stress_tick(stress_t *st) {
+    struct timespec before = st->wake;
+    bool was_armed = st->armed;
+    st->armed = rumble_tick(&st->ctx, &st->now, &st->wake);
+    st->ticks++;
+    if (st->armed && was_armed && timespec_passed(&st->wake, &st->now) &&
+        timespec_cmp(&st->wake, &before) == 0) {
+        if (++st->spins > STRESS_MAX_SPINS) st->error = "scheduler wakes without advancing";
+    } else {
+        st->spins = 0;
+    }
+    if (!st->error) st->error = stress_check(st);
+    return !st->error;
+}
+
+// 虚拟时钟前进 ms, 途中每个唤醒点都 tick, 和 timerfd 驱动的主循环一样
+static bool stress_advance(stress_t *st, unsigned int ms) {
+    struct timespec end = st->now;
+    timespec_add_ms(&end, ms);
+    while (st->armed && timespec_passed(&st->wake, &end)) {
+        if (timespec_cmp(&st->wake, &st->now) > 0) st->now = st->wake;
+        if (!stress_tick(st)) return false;
+    }
+    st->now = end;
+    return true;
+}
+
+// 编码: op, id, 参数 5 字节, 之后前进的毫秒数. id 覆盖负数和越界值
+static bool stress_step(stress_t *st, const uint8_t *b) {
+    static const uint16_t types[] = { FF_RUMBLE, FF_CONSTANT, FF_PERIODIC, FF_SPRING };
+    int id = (int8_t)b[1] % (RUMBLE_MAX_EFFECTS + 4);
+    uint64_t t0 = bench_cpu_ns();
+    switch (b[0] % 6) {
+    case 0: {
+        struct ff_effect e = { .type = types[b[2] & 3], .id = id };
+        e.u.rumble.strong_magnitude = (uint16_t)(b[3] << 8 | b[4]);
+        e.u.rumble.weak_magnitude = (uint16_t)(b[4] << 8 | b[3]);
+        if (e.type == FF_CONSTANT) {
+            e.u.constant.level = (int16_t)(b[3] << 8 | b[4]);
+            e.u.constant.envelope.attack_length = (b[6] & 0x0f) * 20;
+            e.u.constant.envelope.fade_length = (b[6] >> 4) * 20;
+        } else if (e.type == FF_PERIODIC) {
+            e.u.periodic.magnitude = (int16_t)(b[3] << 8 | b[4]);
+            e.u.periodic.envelope.attack_length = (b[6] & 0x0f) * 20;
+            e.u.periodic.envelope.fade_length = (b[6] >> 4) * 20;
+        }
+        e.replay.length = (b[5] & 0x3f) * 16;      // 0 按安全上限
+        e.replay.delay = (b[5] >> 6) * 50;
+        rumble_upload(&st->ctx, &e);
+        break;
+    }
+    case 1: rumble_play(&st->ctx, id, b[2] == 0xff ? 0x7fffffff : b[2] % 4); break;
+    case 2: rumble_play(&st->ctx, id, 0); break;
+    case 3: rumble_erase(&st->ctx, id); break;
+    case 4: rumble_set_gain(&st->ctx, (b[2] << 8 | b[3]) - 0x1000); break;
+    case 5: rumble_set_scale(&st->ctx, b[2] * 4 - 64); break;
+    }
+    bool ok = stress_tick(st);
+    uint64_t ns = bench_cpu_ns() - t0;
+    st->cmds++;
+    st->cmd_ns += ns;
+    if (ns > st->cmd_ns_max) st->cmd_ns_max = ns;
+    return ok && stress_advance(st, b[7]);
+}
+
+// 停掉并删除全部效果, 之后马达必须断电、调度停止
+static bool stress_finish(stress_t *st) {
+    for (int id = 0; id < RUMBLE_MAX_EFFECTS; id++) rumble_erase(&st->ctx, id);
+    if (!stress_tick(st)) return false;
+    if (st->armed) st->error = "still scheduled after all effects were erased";
+    else if (g_bench_gpio_state) st->error = "motor left on after all effects were erased";
+    return !st->error;
+}
+
+static int stress_run(long commands) {
+    static stress_t st;
+    uint8_t cmd[STRESS_CMD_BYTES];
+    stress_begin(&st);
+    srand(1);
+    bool ok = true;
+    for (long i = 0; ok && i < commands; i++) {
+        for (int j = 0; j < STRESS_CMD_BYTES; j++) cmd[j] = (uint8_t)rand();
+        ok = stress_step(&st, cmd);
+    }
+    if (ok) ok = stress_finish(&st);
+    uint64_t writes = g_bench_gpio_writes;
+    stress_end();
+
+    if (!ok) {
+        fprintf(stderr, "FAIL after %llu commands: %s\n", (unsigned long long)st.cmds, st.error);
+        return 1;
+    }
+    printf("stress   %llu commands, %llu ticks, %llu gpio writes: %.0f ns/command, %llu ns worst\n",
+           (unsigned long long)st.cmds, (unsigned long long)st.ticks, (unsigned long long)writes,
+           st.cmds ? (double)st.cmd_ns / st.cmds : 0.0, (unsigned long long)st.cmd_ns_max);
+    return 0;
+}
+
+#ifdef TRIMUI_FUZZ
+// 每 STRESS_CMD_BYTES 字节一条指令; 违反不变量时 abort, 由 libFuzzer 保存输入
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static stress_t st;
+    stress_begin(&st);
+    bool ok = true;
+    for (size_t i = 0; ok && i + STRESS_CMD_BYTES <= size; i += STRESS_CMD_BYTES)
+        ok = stress_step(&st, data + i);
+    if (ok) ok = stress_finish(&st);
+    stress_end();
+    if (!ok) {
+        fprintf(stderr, "rumble invariant violated: %s\n", st.error);
+        abort();
+    }
+    return 0;
+}
+#endif
+
+/* ============================================================
+ * 主循环的各 fd 处理函数
+ * ============================================================ */
+typedef struct {
+    int ctl_fd;
+    int ino_fd;
+    rumble_engine_t *rumble;
+} proxy_t;
+
+static proxy_t g_proxy;
+
+// 处理来自模拟器的震动指令; ctx 为对应的虚拟手柄
+static void on_virt(void *ctx, uint32_t events) {
+    pad_t *pad = ctx;
+    int virt_fd = pad->virt_fd;
+    struct input_event ev;
+    // EPOLLOUT 只用来唤醒, 积压在本轮结束时的 sink_flush 里重试
+    (void)events;
+    while (read(virt_fd, &ev, sizeof(ev)) == sizeof(ev)) {
+        if (ev.type == EV_UINPUT || ev.type == EV_FF) {
+            g_ff_events++;
+            power_wake();
+        }
+        if (ev.type == EV_UINPUT) {
+            if (ev.code == UI_FF_UPLOAD) {
+                struct uinput_ff_upload up; up.request_id = ev.value;
+                if (ioctl(virt_fd, UI_BEGIN_FF_UPLOAD, &up) >= 0) {
+                    STAT_ADD(ff_uploads, 1);
+                    up.retval = pad->rumble ? rumble_engine_upload(pad->rumble, &up.effect)
+                                            : pad_ff_upload(pad, &up.effect);
+                    ioctl(virt_fd, UI_END_FF_UPLOAD, &up);
+                }
+            } else if (ev.code == UI_FF_ERASE) {
+                struct uinput_ff_erase er; er.request_id = ev.value;
+                if (ioctl(virt_fd, UI_BEGIN_FF_ERASE, &er) >= 0) {
+                    STAT_ADD(ff_erases, 1);
+                    if (pad->rumble) rumble_engine_erase(pad->rumble, er.effect_id);
+                    else pad_ff_erase(pad, er.effect_id);
+                    ioctl(virt_fd, UI_END_FF_ERASE, &er);
+                }
+            }
+        } else if (ev.type == EV_FF && !pad->rumble) {
+            if (ev.code != FF_GAIN) STAT_ADD(ff_plays, 1);
+            pad_ff_write(pad, ev.code, ev.value);
+        } else if (ev.type == EV_FF && ev.code == FF_GAIN) {
+            rumble_engine_gain(pad->rumble, ev.value);
+        } else if (ev.type == EV_FF) {
+            STAT_ADD(ff_plays, 1);
+            rumble_engine_play(pad->rumble, ev.code, ev.value);
+        }
+    }
+}
+
+// 真实按键: 只把帧放进共用输出批, 本轮事件分发完后统一 write
+static void on_source(void *ctx, uint32_t events) {
+    source_t *src = ctx;
+    power_wake();
+    if ((events & EPOLLIN) && fwd_drain(&src->fwd, src->fd, g_pads[src->pad].virt_fd) < 0 && errno == ENODEV)
+        events |= EPOLLHUP;
+    // 设备断开; 断开前已经出现的新节点也要立即尝试
+    if (src->fwd.sink->hk_fire) hotkey_dispatch(src->fwd.sink);
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        src_detach(src);
+        src_attach(src, g_sources[0].fwd.profile);
+    }
+}
+
+static void on_hotplug(void *ctx, uint32_t events) {
+    proxy_t *px = ctx;
+    (void)events;
+    if (!hotplug_drain(px->ino_fd) || g_power == POWER_SUSPENDED) return;
+    for (int i = 0; i < g_n_sources; i++) {
+        source_t *src = &g_sources[i];
+        if (src->fd < 0 && src_attach(src, g_sources[0].fwd.profile))
+            printf("Attached %s\n", src->path);
+    }
+}
+
+// 到达 PWM 边沿或停止时间
+static void on_timer(void *ctx, uint32_t events) {
+    proxy_t *px = ctx;
+    struct timespec now;
+    (void)events;
+    timer_ack();
+    timespec_now(&now);
+    if (timer_due(TIMER_RUMBLE, &now)) rumble_service(&px->rumble->ctx);
+    if (timer_due(TIMER_IDLE, &now)) power_idle_check(px->rumble);
+    for (int i = 0; i < g_n_pads; i++) {
+        pad_t *pad = &g_pads[i];
+        int t = pad->sink.timer;
+        if (timer_due(t + TIMER_MACRO, &now)) macro_service(&pad->sink, &now, pad->virt_fd);
+        if (timer_due(t + TIMER_FLUSH, &now)) timer_clear(t + TIMER_FLUSH);   // 本轮结束时的 sink_flush 重试
+        if (timer_due(t + TIMER_ABS, &now)) {
+            // 空帧触发输出攒下的轴值
+            timer_clear(t + TIMER_ABS);
+            sink_emit_simple(&pad->sink, EV_SYN, SYN_REPORT, 0);
+        }
+    }
+}
+
+static void on_ctl(void *ctx, uint32_t events) {
+    proxy_t *px = ctx;
+    (void)events;
+    ctl_handle(px->ctl_fd, px->rumble);
+}
+
+// 启动耗时: 进程内耗时, 以及开机以来的时间 (对照前端探测手柄的时刻)
+static void ready_report(const struct timespec *start) {
+    struct timespec now, boot;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    printf("Ready: %.1f ms after start, %ld.%03ld s since boot\n",
+           (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6,
+           (long)boot.tv_sec, boot.tv_nsec / 1000000);
+    fflush(stdout);
+}
+
+static void handle_signal(int sig) {
+    (void)sig;
+    keep_running = 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --config FILE      read KEY = VALUE options from FILE before the command\n"
+        "                     line (default: %s, skipped if missing)\n"
+        "  --device PATH      physical pad to grab (default: %s)\n"
+        "  --pad-name NAME    virtual pad name (default: cloned from the device)\n"
+        "  --pad-id VID:PID[:VER]\n"
+        "                     virtual pad id in hex (default: cloned from the device)\n"
+        "  --gpio N           global number of the rumble GPIO (default: %d)\n"
+        "  --gpio-path PATH   sysfs value file used without gpiochip\n"
+        "                     (default: /sys/class/gpio/gpioN/value)\n"
+        "  --rt-rumble        run rumble PWM in a dedicated SCHED_FIFO thread\n"
+        "  --rt-cpu N         CPU to pin the rumble thread to (default: last)\n"
+        "  --rt-prio N        SCHED_FIFO priority of the rumble thread (default: %d)\n"
+        "  --hwpwm CHIP[:N]   drive the motor with hardware PWM channel N of CHIP\n"
+        "                     (e.g. /sys/class/pwm/pwmchip0:0)\n"
+        "  --rumble-curve GAMMA[,MIN[,MAX]]\n"
+        "                     magnitude -> duty curve, MIN/MAX duty in permille\n"
+        "                     (default: %.1f,%d,%d)\n"
+        "  --rumble-kick MS   full-power spin-up pulse when a weak effect starts\n"
+        "  --rumble-budget PCT[,SEC]\n"
+        "                     cap the average duty over a SEC window by derating,\n"
+        "                     0 = no cap (default: %d,%d)\n"
+        "  --rumble-range DZ,FULL\n"
+        "                     magnitude deadzone and full-power threshold (default: %d,%d)\n"
+        "  --rumble-mix S,W   strong/weak magnitude weights, 256 = 1.0 (default: %d,%d)\n"
+        "  --rumble-timeout MS\n"
+        "                     longest a single effect may play (default: %d)\n"
+        "  --pwm-hz HZ        software PWM carrier (default: %d)\n"
+        "  --pwm-min-pulse US shortest software PWM pulse (default: %d)\n"
+        "  --hwpwm-hz HZ      hardware PWM carrier (default: %d)\n"
+        "  --filter DZ[,HYST] radial deadzone (permille) and hysteresis for both sticks\n"
+        "  --axis NAME=DZ[,HYST[,MIN:CENTER:MAX]]\n"
+        "                     per-axis filter/calibration (x y z rx ry rz or code)\n"
+        "  --source PATH      also read PATH (e.g. power/volume keys) into the same pad,\n"
+        "                     may be given up to %d times\n"
+        "  --player2 PATH     read PATH (e.g. a Bluetooth/USB pad) into a second\n"
+        "                     virtual pad; its rumble goes to PATH's own FF\n"
+        "  --profile NAME     profile to start with (default, nintendo or one from --profile-dir)\n"
+        "  --map FILE         key/axis remap rules shared by all profiles\n"
+        "  --profile-dir DIR  precompile every DIR/NAME.conf as profile NAME\n"
+        "  --control PATH     control socket for profile switching (default: %s)\n"
+        "  --no-control       do not open the control socket\n"
+        "  --control-group GROUP\n"
+        "                     group allowed to use the control socket (mode 0660)\n"
+        "  --hotkey KEYS=ACTION[,pass]\n"
+        "                     chord of raw key codes (316+305) running exec:SCRIPT or\n"
+        "                     send:SOCKET:MSG; the chord is hidden from the pad unless pass\n"
+        "  --idle-timeout SEC release the motor after SEC idle seconds, 0 = never\n"
+        "                     (default: %d)\n"
+        "  --abs-rate HZ      send stick/trigger updates at most HZ times a second,\n"
+        "                     coalesced per axis; buttons and d-pad pass at once\n"
+        "  --trigger-keys PRESS[,RELEASE]\n"
+        "                     also report L2/R2 as BTN_TL2/BTN_TR2 past PRESS%% of travel\n"
+        "  --stick-dpad PRESS[,RELEASE]\n"
+        "                     also report the left stick as HAT0 past PRESS%% deflection\n"
+        "  --latency          measure input latency, dump histograms on SIGUSR1\n"
+        "  --stats PATH       shared-memory counters for monitoring (default: %s)\n"
+        "  --no-stats         keep the counters in-process only\n"
+        "  --show-stats       print the counters in the stats file and exit\n"
+        "  --record FILE      record forwarded events and FF commands to FILE\n"
+        "  --replay FILE      replay a recorded FILE through a new virtual pad and exit\n"
+        "  --bench [TRACE]    run the off-device benchmark (raw input_event trace\n"
+        "                     file, or a synthetic one) and exit\n"
+        "  --stress [N]       run N randomized FF commands against the rumble state\n"
+        "                     machine, check invariants and exit (default: %d)\n",
+        prog, CONFIG_PATH, REAL_DEV_PATH, RUMBLE_GPIO_NUM, RT_RUMBLE_PRIO, RUMBLE_GAMMA, PWM_MIN_DUTY, RUMBLE_MAX_DUTY,
+        RUMBLE_BUDGET_PCT, RUMBLE_BUDGET_WINDOW_S,
+        RUMBLE_DEADZONE, PWM_THRESHOLD, RUMBLE_STRONG_WEIGHT, RUMBLE_WEAK_WEIGHT, SAFETY_TIMEOUT_MS,
+        PWM_CARRIER_HZ, PWM_MIN_PULSE_US, RUMBLE_HWPWM_HZ, SRC_MAX - 1, CONTROL_SOCK_PATH, IDLE_TIMEOUT_S, STATS_PATH,
+        STRESS_COMMANDS);
+}
+
+// "GAMMA[,MIN[,MAX]]", 占空比为千分比
+static int rumble_curve_parse(const char *spec) {
+    double gamma;
+    int min = g_cfg.rumble_min_duty, max = g_cfg.rumble_max_duty;
+    if (sscanf(spec, "%lf,%d,%d", &gamma, &min, &max) < 1) return -1;
+    if (!(gamma > 0.0 && gamma <= 10.0) || min < 0 || max > 1000 || min > max) return -1;
+    g_cfg.rumble_gamma = gamma;
+    g_cfg.rumble_min_duty = min;
+    g_cfg.rumble_max_duty = max;
+    return 0;
+}
+
+// "A,B" 两个整数
+static int int_pair_parse(const char *spec, int *a, int *b) {
+    char tail;
+    return sscanf(spec, "%d,%d%c", a, b, &tail) == 2 ? 0 : -1;
+}
+
+// "VID:PID[:VER]", 十六进制
+static int pad_id_parse(const char *spec) {
+    unsigned int vid, pid, ver = DEVICE_VERSION;
+    if (sscanf(spec, "%x:%x:%x", &vid, &pid, &ver) < 2 || vid > 0xffff || pid > 0xffff || ver > 0xffff)
+        return -1;
+    g_cfg.pad_id = (struct input_id){ .bustype = BUS_USB, .vendor = (uint16_t)vid,
+                                      .product = (uint16_t)pid, .version = (uint16_t)ver };
+    g_cfg.pad_id_set = true;
+    return 0;
+}
+
+// 组名或数字 gid
+static int group_parse(const char *spec, gid_t *gid) {
+    char *end;
+    long v = strtol(spec, &end, 10);
+    if (*spec && !*end && v >= 0) {
+        *gid = (gid_t)v;
+        return 0;
+    }
+    struct group *gr = getgrnam(spec);
+    if (!gr) return -1;
+    *gid = gr->gr_gid;
+    return 0;
+}
+
+// 配置文件和命令行各调用一次, 后者覆盖前者
+static int parse_args(int argc, char **argv) {
+    enum { OPT_CONFIG = 256, OPT_DEVICE, OPT_PAD_NAME, OPT_PAD_ID, OPT_GPIO, OPT_GPIO_PATH,
+           OPT_RT_RUMBLE, OPT_RT_CPU, OPT_RT_PRIO, OPT_HWPWM, OPT_HWPWM_HZ, OPT_RUMBLE_CURVE, OPT_RUMBLE_KICK, OPT_RUMBLE_BUDGET,
+           OPT_RUMBLE_RANGE, OPT_RUMBLE_MIX, OPT_RUMBLE_TIMEOUT, OPT_PWM_HZ, OPT_PWM_MIN_PULSE, OPT_FILTER, OPT_AXIS, OPT_SOURCE, OPT_PLAYER2, OPT_PROFILE, OPT_MAP, OPT_PROFILE_DIR, OPT_CONTROL, OPT_NO_CONTROL, OPT_CONTROL_GROUP, OPT_HOTKEY, OPT_IDLE_TIMEOUT, OPT_STATS, OPT_NO_STATS, OPT_SHOW_STATS, OPT_ABS_RATE, OPT_TRIGGER_KEYS, OPT_STICK_DPAD, OPT_LATENCY, OPT_RECORD, OPT_REPLAY, OPT_BENCH, OPT_STRESS };
+    static const struct option opts[] = {
+        { "config",    required_argument, NULL, OPT_CONFIG },
+        { "device",    required_argument, NULL, OPT_DEVICE },
+        { "pad-name",  required_argument, NULL, OPT_PAD_NAME },
+        { "pad-id",    required_argument, NULL, OPT_PAD_ID },
+        { "gpio",      required_argument, NULL, OPT_GPIO },
+        { "gpio-path", required_argument, NULL, OPT_GPIO_PATH },
+        { "rt-rumble", no_argument,       NULL, OPT_RT_RUMBLE },
+        { "rt-cpu",    required_argument, NULL, OPT_RT_CPU },
+        { "rt-prio",   required_argument, NULL, OPT_RT_PRIO },
+        { "hwpwm",     required_argument, NULL, OPT_HWPWM },
+        { "rumble-curve", required_argument, NULL, OPT_RUMBLE_CURVE },
+        { "rumble-kick", required_argument, NULL, OPT_RUMBLE_KICK },
+        { "rumble-budget", required_argument, NULL, OPT_RUMBLE_BUDGET },
+        { "rumble-range", required_argument, NULL, OPT_RUMBLE_RANGE },
+        { "rumble-mix", required_argument, NULL, OPT_RUMBLE_MIX },
+        { "rumble-timeout", required_argument, NULL, OPT_RUMBLE_TIMEOUT },
+        { "pwm-hz",    required_argument, NULL, OPT_PWM_HZ },
+        { "pwm-min-pulse", required_argument, NULL, OPT_PWM_MIN_PULSE },
+        { "hwpwm-hz",  required_argument, NULL, OPT_HWPWM_HZ },
+        { "filter",    required_argument, NULL, OPT_FILTER },
+        { "axis",      required_argument, NULL, OPT_AXIS },
+        { "source",    required_argument, NULL, OPT_SOURCE },
+        { "player2",   required_argument, NULL, OPT_PLAYER2 },
+        { "profile",   required_argument, NULL, OPT_PROFILE },
+        { "map",       required_argument, NULL, OPT_MAP },
+        { "profile-dir", required_argument, NULL, OPT_PROFILE_DIR },
+        { "control",   required_argument, NULL, OPT_CONTROL },
+        { "control-group", required_argument, NULL, OPT_CONTROL_GROUP },
+        { "no-control", no_argument,      NULL, OPT_NO_CONTROL },
+        { "hotkey",    required_argument, NULL, OPT_HOTKEY },
+        { "idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT },
+        { "stats",     required_argument, NULL, OPT_STATS },
+        { "no-stats",  no_argument,       NULL, OPT_NO_STATS },
+        { "show-stats", no_argument,      NULL, OPT_SHOW_STATS },
+        { "abs-rate",  required_argument, NULL, OPT_ABS_RATE },
+        { "trigger-keys", required_argument, NULL, OPT_TRIGGER_KEYS },
+        { "stick-dpad", required_argument, NULL, OPT_STICK_DPAD },
+        { "latency",   no_argument,       NULL, OPT_LATENCY },
+        { "record",    required_argument, NULL, OPT_RECORD },
+        { "replay",    required_argument, NULL, OPT_REPLAY },
+        { "bench",     optional_argument, NULL, OPT_BENCH },
+        { "stress",    optional_argument, NULL, OPT_STRESS },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    optind = 0;   // 第二次调用时让 getopt 完整重新初始化
+    while ((c = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+        switch (c) {
+        case OPT_CONFIG:    break;   // 已由 config_arg 预先取出
+        case OPT_DEVICE:    g_sources[0].path = optarg; break;
+        case OPT_PAD_NAME:  g_cfg.pad_name = optarg; break;
+        case OPT_PAD_ID:
+            if (pad_id_parse(optarg) < 0) {
+                fprintf(stderr, "Bad --pad-id value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_GPIO:      g_cfg.gpio_num = atoi(optarg); break;
+        case OPT_GPIO_PATH: g_cfg.gpio_path = optarg; break;
+        case OPT_RT_RUMBLE: g_cfg.rt_rumble = true; break;
+        case OPT_RT_CPU:    g_cfg.rt_cpu = atoi(optarg); break;
+        case OPT_RT_PRIO:   g_cfg.rt_prio = atoi(optarg); break;
+        case OPT_RUMBLE_CURVE:
+            if (rumble_curve_parse(optarg) < 0) {
+                fprintf(stderr, "Bad --rumble-curve value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_RUMBLE_KICK: g_cfg.rumble_kick_ms = atoi(optarg); break;
+        case OPT_RUMBLE_BUDGET:
+            if (sscanf(optarg, "%d,%d", &g_cfg.rumble_budget, &g_cfg.rumble_window_s) < 1) {
+                fprintf(stderr, "Bad --rumble-budget value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_RUMBLE_RANGE:
+            if (int_pair_parse(optarg, &g_cfg.rumble_deadzone, &g_cfg.rumble_full) < 0) {
+                fprintf(stderr, "Bad --rumble-range value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_RUMBLE_MIX:
+            if (int_pair_parse(optarg, &g_cfg.rumble_weight[0], &g_cfg.rumble_weight[1]) < 0) {
+                fprintf(stderr, "Bad --rumble-mix value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_RUMBLE_TIMEOUT: g_cfg.rumble_timeout_ms = atoi(optarg); break;
+        case OPT_PWM_HZ:    g_cfg.pwm_hz = atoi(optarg); break;
+        case OPT_PWM_MIN_PULSE: g_cfg.pwm_min_pulse_us = atoi(optarg); break;
+        case OPT_HWPWM_HZ:  g_cfg.hwpwm_hz = atoi(optarg); break;
+        case OPT_FILTER:
+            if (stick_filter_parse(optarg, g_cfg.axis) < 0) {
+                fprintf(stderr, "Bad --filter value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_AXIS:
+            if (axis_option_parse(optarg, g_cfg.axis) < 0) {
+                fprintf(stderr, "Bad --axis value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_SOURCE:
+        case OPT_PLAYER2:
+            if (g_n_sources >= SRC_MAX) {
+                fprintf(stderr, "Too many --source/--player2 devices (max %d)\n", SRC_MAX - 1);
+                return -1;
+            }
+            g_sources[g_n_sources++] = (source_t){ .path = optarg, .fd = -1, .pad = c == OPT_PLAYER2 };
+            if (c == OPT_PLAYER2) g_n_pads = 2;
+            break;
+        case OPT_PROFILE:   g_cfg.profile = optarg; break;
+        case OPT_MAP:       g_cfg.remap_file = optarg; break;
+        case OPT_PROFILE_DIR: g_cfg.profile_dir = optarg; break;
+        case OPT_CONTROL:   g_cfg.control_path = optarg; break;
+        case OPT_NO_CONTROL: g_cfg.control_path = NULL; break;
+        case OPT_CONTROL_GROUP:
+            if (group_parse(optarg, &g_cfg.control_gid) < 0) {
+                fprintf(stderr, "Bad --control-group value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_IDLE_TIMEOUT: g_cfg.idle_timeout = atoi(optarg); break;
+        case OPT_HOTKEY:
+            if (hotkey_parse(optarg) < 0) {
+                fprintf(stderr, "Bad --hotkey value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_ABS_RATE:  g_cfg.abs_rate = atoi(optarg); break;
+        case OPT_TRIGGER_KEYS:
+        case OPT_STICK_DPAD: {
+            int *pct = c == OPT_TRIGGER_KEYS ? g_cfg.trigger_keys : g_cfg.stick_dpad;
+            if (derive_pct_parse(optarg, &pct[0], &pct[1]) < 0) {
+                fprintf(stderr, "Bad --%s value: %s\n", c == OPT_TRIGGER_KEYS ? "trigger-keys" : "stick-dpad", optarg);
+                return -1;
+            }
+            break;
+        }
+        case OPT_LATENCY:   g_cfg.latency = true; break;
+        case OPT_STATS:     g_cfg.stats_path = optarg; break;
+        case OPT_NO_STATS:  g_cfg.stats_path = NULL; break;
+        case OPT_SHOW_STATS: g_cfg.show_stats = true; break;
+        case OPT_RECORD:    g_cfg.record_path = optarg; break;
+        case OPT_REPLAY:    g_cfg.replay_path = optarg; break;
+        case OPT_BENCH:
+            g_cfg.bench = true;
+            // 允许 "--bench TRACE" 与 "--bench=TRACE" 两种写法
+            if (!optarg && optind < argc && argv[optind][0] != '-') optarg = argv[optind++];
+            g_cfg.bench_trace = optarg;
+            break;
+        case OPT_STRESS:
+            if (!optarg && optind < argc && argv[optind][0] != '-') optarg = argv[optind++];
+            g_cfg.stress = optarg ? atol(optarg) : STRESS_COMMANDS;
+            if (g_cfg.stress <= 0) {
+                fprintf(stderr, "Bad --stress value: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case OPT_HWPWM: {
+            // CHIP[:N], 冒号只在最后一个路径分隔符之后才算通道号
+            char *colon = strrchr(optarg, ':');
+            if (colon && colon > strrchr(optarg, '/')) {
+                *colon = '\0';
+                g_cfg.hwpwm_channel = atoi(colon + 1);
+            }
+            g_cfg.hwpwm_chip = optarg;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ============================================================
+ * 配置文件: 每行 "KEY = VALUE", KEY 为去掉 "--" 的长选项名, 不带参数的选项只写 KEY;
+ * [节] 只用于分组, # 或 ; 开头为注释. 启动时读一次, 之后命令行覆盖
+ * ============================================================ */
+#define CONFIG_MAX_ENTRIES 128
+
+// 命令行里的 --config 要在解析其它选项之前取出
+static const char *config_arg(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) break;
+        if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) return argv[i + 1];
+        if (strncmp(argv[i], "--config=", 9) == 0) return argv[i] + 9;
+    }
+    return NULL;
+}
+
+static char *config_trim(char *s) {
+    while (*s == ' ' || *s == '\t') s++;
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) end--;
+    *end = '\0';
+    return s;
+}
+
+// 把每一项拼成 "--KEY=VALUE" 交给 parse_args; 字符串在整个运行期间保留, 选项值直接指向它们
+static int config_load(const char *path, bool required, char *prog) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        if (!required && errno == ENOENT) return 0;
+        fprintf(stderr, "Cannot read config %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    static char *argv[CONFIG_MAX_ENTRIES + 1];
+    int argc = 0;
+    argv[argc++] = prog;
+    char line[512];
+    int lineno = 0, ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *key = config_trim(line);
+        if (!*key || *key == '#' || *key == ';' || *key == '[') continue;
+
+        char *val = strchr(key, '=');
+        if (val) {
+            *val = '\0';
+            val = config_trim(val + 1);
+            key = config_trim(key);
+        }
+        if (argc >= CONFIG_MAX_ENTRIES) {
+            fprintf(stderr, "%s:%d: too many entries (max %d)\n", path, lineno, CONFIG_MAX_ENTRIES);
+            ret = -1;
+            break;
+        }
+        size_t len = strlen(key) + (val ? strlen(val) + 1 : 0) + 3;
+        char *opt = malloc(len);
+        if (!opt) {
+            ret = -1;
+            break;
+        }
+        snprintf(opt, len, "--%s%s%s", key, val ? "=" : "", val ? val : "");
+        argv[argc++] = opt;
+    }
+    fclose(f);
+    if (ret == 0 && argc > 1 && parse_args(argc, argv) < 0) {
+        fprintf(stderr, "Bad option in config %s\n", path);
+        ret = -1;
+    }
+    return ret;
+}
+
+// 检查取值并换算出运行时直接使用的参数
+static int config_finalize(void) {
+    static char gpio_path[64];
+    if (!g_cfg.gpio_path) {
+        snprintf(gpio_path, sizeof(gpio_path), RUMBLE_GPIO_SYSFS, g_cfg.gpio_num);
+        g_cfg.gpio_path = gpio_path;
+    }
+    if (g_cfg.rumble_deadzone < 0 || g_cfg.rumble_full <= g_cfg.rumble_deadzone || g_cfg.rumble_full > 0xffff) {
+        fprintf(stderr, "Bad rumble range %d,%d\n", g_cfg.rumble_deadzone, g_cfg.rumble_full);
+        return -1;
+    }
+    if (g_cfg.rumble_weight[0] < 0 || g_cfg.rumble_weight[0] > 512 ||
+        g_cfg.rumble_weight[1] < 0 || g_cfg.rumble_weight[1] > 512) {
+        fprintf(stderr, "Bad rumble mix %d,%d (0..512)\n", g_cfg.rumble_weight[0], g_cfg.rumble_weight[1]);
+        return -1;
+    }
+    if (g_cfg.rumble_timeout_ms <= 0) {
+        fprintf(stderr, "Bad rumble timeout %d\n", g_cfg.rumble_timeout_ms);
+        return -1;
+    }
+    if (g_cfg.pwm_hz <= 0 || g_cfg.pwm_hz > 1000 || g_cfg.hwpwm_hz <= 0 || g_cfg.hwpwm_hz > 1000000) {
+        fprintf(stderr, "Bad PWM carrier %d/%d Hz\n", g_cfg.pwm_hz, g_cfg.hwpwm_hz);
+        return -1;
+    }
+    if (g_cfg.rumble_budget < 0 || g_cfg.rumble_budget > 100 ||
+        g_cfg.rumble_window_s <= 0 || g_cfg.rumble_window_s > 3600) {
+        fprintf(stderr, "Bad rumble budget %d%%,%ds\n", g_cfg.rumble_budget, g_cfg.rumble_window_s);
+        return -1;
+    }
+    // 100% 等于不限
+    g_pwm.budget = g_cfg.rumble_budget < 100 ? (uint32_t)g_cfg.rumble_budget * 10 : 0;
+    g_pwm.window_ms = g_cfg.rumble_window_s * 1000L;
+    if (g_cfg.abs_rate < 0 || g_cfg.abs_rate > 1000) {
+        fprintf(stderr, "Bad abs rate %d Hz (0..1000)\n", g_cfg.abs_rate);
+        return -1;
+    }
+    g_abs_interval_ns = g_cfg.abs_rate ? 1000000000L / g_cfg.abs_rate : 0;
+    g_pwm.period_ns = 1000000000L / g_cfg.pwm_hz;
+    g_pwm.min_pulse_ns = g_cfg.pwm_min_pulse_us * 1000L;
+    if (g_pwm.min_pulse_ns < 0 || g_pwm.min_pulse_ns * 2 > g_pwm.period_ns) {
+        fprintf(stderr, "Bad PWM min pulse %d us for %d Hz\n", g_cfg.pwm_min_pulse_us, g_cfg.pwm_hz);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef TRIMUI_FUZZ
+// main 由 libFuzzer 提供; 守护进程入口改名保留, 它用到的函数照常编译, 不会报未使用
+#define main trimui_inputd_main
+int main(int argc, char **argv);
+#endif
+int main(int argc, char **argv) {
+    struct timespec t_start;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    g_cfg.control_path = CONTROL_SOCK_PATH;
+    g_cfg.stats_path = STATS_PATH;
+    const char *config = config_arg(argc, argv);
+    if (config_load(config ? config : CONFIG_PATH, config != NULL, argv[0]) < 0) return 1;
+    if (parse_args(argc, argv) < 0 || config_finalize() < 0) return 1;
+    if (g_cfg.bench) return bench_run(g_cfg.bench_trace);
+    if (g_cfg.stress) return stress_run(g_cfg.stress);
+    if (g_cfg.show_stats) return stats_show(g_cfg.stats_path ? g_cfg.stats_path : STATS_PATH);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    if (g_n_hotkeys) signal(SIGCHLD, SIG_IGN);   // 组合键启动的脚本不需要回收
+    if (g_cfg.latency) signal(SIGUSR1, handle_sigusr1);
+    if (g_cfg.replay_path) return replay_run(g_cfg.replay_path);
+
+    motor_init();
+    static rumble_engine_t rumble;
+    rumble_init(&rumble.ctx);
+
+    // 1. 解析方案; 重映射目标要在创建虚拟手柄时声明, 不需要真实设备
+    const profile_t *profile = profile_init();
+    if (!profile) {
+        profile_free_all();
+        return 1;
+    }
+
+    // 2. 真实设备已经在就照抄它的能力; 不在就用原厂描述, 之后按量程换算
+    source_t *primary = &g_sources[0];
+    primary->fd = src_open(primary->path, false);
+    if (primary->fd >= 0) pad_desc_clone(&g_pad, primary->fd);
+    else pad_desc_stock(&g_pad);
+    unsigned long base_keys[NLONGS(KEY_CNT)];
+    memcpy(base_keys, g_pad.keybit, sizeof(base_keys));
+    profile_pad_targets(&g_pad);
+    pad_desc_extra_keys(&g_pad, base_keys, true);
+
+    // Player2 以 Player1 为底; 附加来源暂时打不开的等热插拔, 已打开的按键要在各自的虚拟手柄上声明
+    static pad_desc_t pad2;
+    pad_desc_player2(&pad2, &g_pad);
+    pad_desc_t *desc[PAD_MAX] = { &g_pad, &pad2 };
+    for (int i = 1; i < g_n_sources; i++) {
+        source_t *src = &g_sources[i];
+        unsigned long keybit[NLONGS(KEY_CNT)] = {0};
+        if ((src->fd = src_open(src->path, src->pad > 0)) < 0) {
+            fprintf(stderr, "WARN: Cannot open %s, waiting for it\n", src->path);
+            continue;
+        }
+        ioctl(src->fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit);
+        for (unsigned int j = 0; j < NLONGS(KEY_CNT); j++) desc[src->pad]->keybit[j] |= keybit[j];
+    }
+
+    // 3. 先创建虚拟设备, 前端可以在等待真实设备期间就开始枚举
+    for (int i = 0; i < g_n_pads; i++) {
+        pad_t *pad = &g_pads[i];
+        pad->sink.timer = TIMER_PAD + i * TIMER_PAD_SLOTS;
+        pad->rumble = i == 0 ? &rumble : NULL;
+        pad->handler = (loop_handler_t){ .fn = on_virt, .ctx = pad };
+        if ((pad->virt_fd = pad_create(desc[i])) < 0) {
+            perror("Virtual creation failed");
+            pads_destroy();
+            profile_free_all();
+            return 1;
+        }
+        pad->sink.fd = pad->virt_fd;
+    }
+
+    // 4. 被脚本隐藏的真实设备 (已 Grab) 还不存在就等它出现
+    int ino_fd = hotplug_init();
+    if (ino_fd < 0) fprintf(stderr, "WARN: inotify on %s failed, hotplug disabled\n", g_hotplug_dir);
+    if (primary->fd < 0 && ino_fd >= 0) {
+        printf("Waiting for %s...\n", primary->path);
+        primary->fd = src_wait(ino_fd, primary->path);
+    }
+    if (primary->fd < 0) {
+        if (keep_running)
+            fprintf(stderr, "FATAL: Cannot open %s. Please run start_proxy.sh first!\n", primary->path);
+        if (ino_fd >= 0) close(ino_fd);
+        pads_destroy();
+        profile_free_all();
+        return 1;
+    }
+    int src_fd = primary->fd;
+    profile_bind_all(src_fd, g_pad.abs);
+
+    if (timer_init() < 0) {
+        perror("timerfd_create");
+        pads_destroy();
+        ioctl(src_fd, EVIOCGRAB, 0);
+        close(src_fd);
+        return 1;
+    }
+
+    if (g_cfg.rt_rumble && rumble_thread_start(&rumble) < 0)
+        fprintf(stderr, "WARN: Cannot start rumble thread, falling back to main loop\n");
+
+    if (g_cfg.record_path) rec_open(g_cfg.record_path);
+    if (g_cfg.stats_path && stats_open(g_cfg.stats_path) < 0)
+        fprintf(stderr, "WARN: Cannot map stats file %s: %s\n", g_cfg.stats_path, strerror(errno));
+
+    for (int i = 0; i < g_n_sources; i++) {
+        source_t *src = &g_sources[i];
+        if (src->fd < 0) continue;
+        fwd_init(&src->fwd, src->fd, &g_pads[src->pad].sink, profile, i == 0);
+        fwd_resync(&src->fwd, src->fd, g_pads[src->pad].virt_fd);
+    }
+    for (int i = 1; i < g_n_pads; i++) pad_ff_rebind(&g_pads[i]);
+    rumble_engine_scale(&rumble, profile->rumble_scale);
+
+    int ctl_fd = -1;
+    if (g_cfg.control_path && (ctl_fd = ctl_open(g_cfg.control_path)) < 0)
+        fprintf(stderr, "WARN: Cannot open control socket %s: %s\n", g_cfg.control_path, strerror(errno));
+
+    g_proxy = (proxy_t){ .ctl_fd = ctl_fd, .ino_fd = ino_fd, .rumble = &rumble };
+    static loop_handler_t h_timer = { .fn = on_timer, .ctx = &g_proxy },
+                          h_ctl = { .fn = on_ctl, .ctx = &g_proxy },
+                          h_hotplug = { .fn = on_hotplug, .ctx = &g_proxy };
+    if ((g_loop_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        keep_running = 0;
+    } else {
+        for (int i = 0; i < g_n_pads; i++) loop_add(g_pads[i].virt_fd, &g_pads[i].handler);
+        loop_add(g_timer_fd, &h_timer);
+        if (ctl_fd >= 0) loop_add(ctl_fd, &h_ctl);
+        if (ino_fd >= 0) loop_add(ino_fd, &h_hotplug);
+        for (int i = 0; i < g_n_sources; i++) {
+            source_t *src = &g_sources[i];
+            src->handler = (loop_handler_t){ .fn = on_source, .ctx = src };
+            if (src->fd >= 0) loop_add(src->fd, &src->handler);
+        }
+    }
+
+    printf("Proxy started. Reading %s, Outputting Virtual Pad with PWM Rumble.\n", primary->path);
+    ready_report(&t_start);
+    power_arm_idle();
+    timer_commit();
+
+    while (keep_running) {
+        // 没有震动时无限期阻塞, 震动时由 timerfd 在边沿唤醒
+        int n = loop_run_once();
+        if (n < 0) break;
+        // 信号可能在处理事件期间到达, 每轮都检查, 不依赖 epoll_wait 被打断
+        if (g_lat_dump_requested) {
+            g_lat_dump_requested = 0;
+            lat_dump();
+        }
+        // 每个虚拟手柄上所有来源的帧合并为一次 write; 写不进去的排队等 EPOLLOUT
+        for (int i = 0; i < g_n_pads; i++) {
+            pad_t *pad = &g_pads[i];
+            sink_flush(&pad->sink, pad->virt_fd);
+            loop_want_write(pad->virt_fd, &pad->handler, sink_pending(&pad->sink));
+        }
+        timer_commit();
+    }
 
-    ioctl(src_fd, EVIOCGRAB, 0);
-    close(src_fd);
+    // 清理
+    rumble_thread_stop(&rumble);
+    motor_close();
+    rec_close();
+    stats_close();
+    close(g_timer_fd);
+    ctl_close(ctl_fd, g_cfg.control_path);
+    hotkey_close();
+    profile_free_all();
+    if (g_loop_fd >= 0) close(g_loop_fd);
+
+    pads_destroy();
+
+    for (int i = 0; i < g_n_sources; i++) {
+        if (g_sources[i].fd < 0) continue;
+        ioctl(g_sources[i].fd, EVIOCGRAB, 0);
+        close(g_sources[i].fd);
+    }
+    if (ino_fd >= 0) close(ino_fd);
 
     return 0;
 }